@@ -0,0 +1,486 @@
+// A reproducible benchmark for the sorter. It generates synthetic claims in the exact Claim layout, then times the
+// whole pipeline and each of its phases alone over a grid of buffer sizes and thread counts.
+//
+//     g++ -std=c++17 -O2 -pthread -o tpmms-bench bench/bench.cpp
+//     ./tpmms-bench --records 1000000 --clients 50000 --zipf 1.1 --buffers 8M,64M --threads 1,4
+//
+// With --verify it times nothing. It runs the whole pipeline in every sorter mode over the same grid instead,
+// and checks that each mode writes the same files as the default one does, with every input record among the sorted claims.
+//
+// The generator draws from its own seeded random number generator rather than the distributions of <random>,
+// whose output differs between standard libraries, so the same flags give the same input everywhere.
+
+#define TPMMS_NO_MAIN
+#include "../main.cpp"
+#include <cmath>
+#include <iomanip>
+#include <unordered_set>
+
+// splitmix64: small, fast and the same on every platform.
+class BenchRandom {
+public:
+    explicit BenchRandom(uint64_t seed) : _state(seed) {}
+    
+    uint64_t Next() {
+        uint64_t z = (_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    
+    double Uniform() { return (Next() >> 11) * (1.0 / 9007199254740992.0); } //  [0, 1), from the top 53 bits.
+    uint64_t Below(uint64_t n) { return (n == 0) ? 0 : Next() % n; }
+
+private:
+    uint64_t _state;
+};
+
+// The shape of the synthetic input.
+struct ClaimShape {
+    ClaimShape()
+    : records(1000000)
+    , clients(10000)
+    , zipf(0)
+    , sorted(0)
+    , duplicates(0)
+    , seed(1)
+    , finalNewline(true) {}
+    
+    uint64_t records;
+    uint64_t clients; //    distinct client IDs to draw from.
+    double zipf; // the skew of the claims per client: 0 draws clients uniformly, 1 and more concentrates them on a few.
+    double sorted; //   the fraction of records left in client order; the others are shuffled among themselves.
+    double duplicates; //   the fraction of records that repeat an earlier record, claim number and all.
+    uint64_t seed;
+    bool finalNewline; //   false leaves the last line unterminated, as some editors and exports do.
+};
+
+// A claim before it is formatted: everything else in the line follows from these fields.
+struct SyntheticClaim {
+    uint32_t claimNumber;
+    uint32_t clientID;
+    uint16_t month;
+    uint16_t day;
+    uint16_t street;
+    uint16_t insuredItem;
+    uint32_t damageCents;
+    uint32_t compensationCents;
+};
+
+// Writes records synthetic claims to fileName. Client ranks are drawn uniformly or from a Zipf distribution,
+// and every rank gets a random 9-digit ID, so the most popular clients are not also the smallest keys.
+bool generateClaims(const ClaimShape &shape, const std::string &fileName) {
+    if (shape.records > 100000000) { //   the claim number is 8 digits wide.
+        std::cerr << "The Claim layout holds at most 100000000 claims." << std::endl;
+        return false;
+    }
+    if (shape.clients > 100000000) { //   every client gets a distinct 9-digit ID, drawn at random.
+        std::cerr << "The generator draws at most 100000000 distinct clients." << std::endl;
+        return false;
+    }
+    BenchRandom random(shape.seed);
+    const uint64_t clients = std::max<uint64_t>(shape.clients, 1);
+    std::vector<double> cumulative; //   the Zipf distribution over client ranks, if there is any skew.
+    if (shape.zipf > 0) {
+        cumulative.resize(clients);
+        double sum = 0;
+        for (uint64_t r = 0; r < clients; ++r)
+            cumulative[r] = (sum += 1.0 / pow((double)(r + 1), shape.zipf));
+        for (uint64_t r = 0; r < clients; ++r)
+            cumulative[r] /= sum;
+    }
+    std::vector<uint32_t> ids;
+    std::unordered_set<uint32_t> taken;
+    while (ids.size() < clients) {
+        const uint32_t id = (uint32_t)random.Below(1000000000);
+        if (taken.insert(id).second) ids.push_back(id);
+    }
+    
+    std::vector<SyntheticClaim> claims(shape.records);
+    for (uint64_t i = 0; i < shape.records; ++i) {
+        SyntheticClaim &claim = claims[i];
+        if (i > 0 && random.Uniform() < shape.duplicates) {
+            claim = claims[random.Below(i)];
+            continue;
+        }
+        uint64_t rank = random.Below(clients);
+        if (cumulative.empty() == false)
+            rank = std::lower_bound(cumulative.begin(), cumulative.end(), random.Uniform()) - cumulative.begin();
+        claim.claimNumber = (uint32_t)i;
+        claim.clientID = ids[std::min(rank, clients - 1)];
+        claim.month = 1 + random.Below(12);
+        claim.day = 1 + random.Below(28);
+        claim.street = 1 + random.Below(999);
+        claim.insuredItem = random.Below(100);
+        claim.damageCents = random.Below(100000000);
+        claim.compensationCents = random.Below(100000000);
+    }
+    
+    // Pre-sortedness: put every claim in client order, then shuffle a random subset of the positions among themselves.
+    if (shape.sorted > 0) {
+        std::stable_sort(claims.begin(), claims.end(), [](const SyntheticClaim &a, const SyntheticClaim &b) { return a.clientID < b.clientID; });
+    }
+    std::vector<uint64_t> shuffled;
+    for (uint64_t i = 0; i < shape.records; ++i)
+        if (shape.sorted <= 0 || random.Uniform() >= shape.sorted) shuffled.push_back(i);
+    for (uint64_t i = shuffled.size(); i > 1; --i)
+        std::swap(claims[shuffled[i - 1]], claims[shuffled[random.Below(i)]]);
+    
+    FILE* output = fopen(fileName.c_str(), "w");
+    if (output == NULL) {
+        std::cerr << "Unable to create " << fileName << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    char line[512];
+    for (uint64_t i = 0; i < shape.records; ++i) {
+        const SyntheticClaim &claim = claims[i];
+        char name[32], address[32], email[32];
+        snprintf(name, sizeof(name), "Name%u", claim.clientID);
+        snprintf(address, sizeof(address), "%u Some Street, City", claim.street);
+        snprintf(email, sizeof(email), "c%u@mail.com", claim.clientID);
+        const int length = snprintf(line, sizeof(line), "%08u2018-%02u-%02u%09u%-25s%-150s%-28s%02u%09.2f%010.2f\n",
+                                    claim.claimNumber, claim.month, claim.day, claim.clientID, name, address, email,
+                                    claim.insuredItem, claim.damageCents / 100.0, claim.compensationCents / 100.0);
+        const bool last = (i + 1 == shape.records);
+        fwrite(line, 1, (last && !shape.finalNewline) ? length - 1 : length, output);
+    }
+    return fclose(output) == 0;
+}
+
+// What one benchmark takes as input and how long it took.
+struct BenchResult {
+    std::string benchmark;
+    std::string buffer;
+    unsigned int threads;
+    uint64_t bytes; //  the size of the benchmark's input, which the throughput is measured against.
+    uint64_t records;
+    PhaseReport median; //  the repetition with the median wall time.
+};
+
+// Checksums of what one run of the pipeline wrote: of each file, and of its lines in any order.
+struct PipelineOutput {
+    uint64_t sorted; // 0 when the mode writes no sorted claims.
+    uint64_t sortedRecords;
+    uint64_t sums;
+    uint64_t ranked;
+    uint64_t sumsLines;
+    uint64_t rankedLines;
+};
+
+// Runs the benchmarks over the grid. Work a benchmark needs done first (a sort before the summing pass,
+// the sums before the ranking) runs untimed, outside its meter.
+class Bench {
+public:
+    Bench(const std::string &input, const std::string &temporaryPath, const SorterOptions &options, unsigned int repeat)
+    : _input(input)
+    , _temporaryPath(temporaryPath)
+    , _options(options)
+    , _repeat(std::max(1u, repeat)) {
+        _sorted = temporaryPath + "/bench-sorted.txt";
+        _sums = temporaryPath + "/bench-sums.txt";
+        _ranked = temporaryPath + "/bench-ranked.txt";
+    }
+    
+    ~Bench() {
+        remove(_sorted.c_str());
+        remove(_sums.c_str());
+        remove(_ranked.c_str());
+    }
+    
+    static bool Known(const std::string &benchmark) {
+        static const char* names[] = {"pipeline", "pass1", "pass2", "sum", "fused", "hash", "rank", "select"};
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+            if (benchmark == names[i]) return true;
+        return false;
+    }
+    
+    //  The modes --verify compares, as the flags that select them. "--aggregate" and "--resume" are the bench's own:
+    //  --resume has the sort pick up the runs that an interrupted, checkpointed sort left behind.
+    static std::vector<std::string> VerifyModes() {
+        static const char* modes[] = {
+            "", "--no-mmap", "--direct-sort", "--no-mmap --direct-sort", "--tag-sort", "--radix-sort", "--replacement-selection",
+            "--compress-runs lz4", "--io sync", "--io threads", "--direct-io",
+            "--checkpoint", "--checkpoint --resume", "--no-mmap --checkpoint --resume",
+            "--aggregate fused", "--aggregate hash"
+        };
+        return std::vector<std::string>(modes, modes + sizeof(modes) / sizeof(modes[0]));
+    }
+    
+    PipelineOutput Outputs(const std::string &mode, const std::string &buffer, unsigned int threads) {
+        SorterOptions options = _options;
+        std::string aggregation = "separate";
+        bool resume = false;
+        std::vector<std::string> words = splitWords(mode);
+        std::vector<char*> flags;
+        for (size_t i = 0; i < words.size(); ++i)
+            flags.push_back(&words[i][0]);
+        for (int i = 0; i < (int)flags.size(); ++i) {
+            if (words[i] == "--aggregate" && i + 1 < (int)flags.size()) aggregation = words[++i];
+            else if (words[i] == "--resume") resume = true;
+            else parseSorterOption((int)flags.size(), &flags[0], i, options);
+        }
+        options.threads = threads;
+        
+        PipelineOutput output = {0, 0, 0, 0, 0, 0};
+        std::streambuf* console = std::cout.rdbuf(NULL);
+        std::vector<std::string> manifests;
+        if (aggregation == "fused") TPMMSAggregate(_input, _sums, buffer, _temporaryPath, options).Sort();
+        else if (aggregation == "hash") ClientHashAggregator(_input, _sums, buffer, _temporaryPath, options).Aggregate();
+        else {
+            TPMMS sorter(_input, _sorted, buffer, _temporaryPath, options);
+            manifests.push_back(sorter.CheckpointFileName());
+            remove(manifests.back().c_str());
+            if (resume) Interrupt(buffer, options);
+            sorter.Sort();
+            SumOfCompensationAmounts(_sorted, _sums);
+            output.sorted = Checksum(_sorted, false);
+            output.sortedRecords = Lines(_sorted);
+        }
+        TPMMS2 ranker(_sums, _ranked, buffer, _temporaryPath, options);
+        manifests.push_back(ranker.CheckpointFileName());
+        remove(manifests.back().c_str());
+        ranker.Sort();
+        std::cout.rdbuf(console);
+        std::cout.clear();
+        for (size_t i = 0; i < manifests.size(); ++i)
+            remove(manifests[i].c_str());
+        output.sums = Checksum(_sums, false);
+        output.ranked = Checksum(_ranked, false);
+        output.sumsLines = Checksum(_sums, true);
+        output.rankedLines = Checksum(_ranked, true);
+        return output;
+    }
+    
+    static uint64_t Lines(const std::string &fileName) { //    an unterminated last line counts too.
+        std::ifstream input(fileName.c_str(), std::ios::in | std::ios::binary);
+        uint64_t lines = 0;
+        char block[1 << 16], last = '\n';
+        while (input.read(block, sizeof(block)) || input.gcount() > 0) {
+            lines += std::count(block, block + input.gcount(), '\n');
+            last = block[input.gcount() - 1];
+        }
+        return lines + (last != '\n' ? 1 : 0);
+    }
+    
+    BenchResult Run(const std::string &benchmark, const std::string &buffer, unsigned int threads) {
+        SorterOptions options = _options;
+        options.threads = threads;
+        BenchResult result;
+        result.benchmark = benchmark;
+        result.buffer = buffer;
+        result.threads = threads;
+        std::vector<PhaseReport> runs;
+        std::streambuf* console = std::cout.rdbuf(NULL); //   the sorters' progress lines would drown the results.
+        for (unsigned int r = 0; r < _repeat; ++r)
+            runs.push_back(RunOnce(benchmark, buffer, options, result));
+        std::cout.rdbuf(console);
+        std::cout.clear();
+        std::sort(runs.begin(), runs.end(), [](const PhaseReport &a, const PhaseReport &b) { return a.wallSeconds < b.wallSeconds; });
+        result.median = runs[runs.size() / 2];
+        return result;
+    }
+
+private:
+    PhaseReport RunOnce(const std::string &benchmark, const std::string &buffer, const SorterOptions &options, BenchResult &result) {
+        const bool onSums = (benchmark == "rank" || benchmark == "select");
+        if (benchmark == "sum") TPMMS(_input, _sorted, buffer, _temporaryPath, options).Sort();
+        if (onSums) ClientHashAggregator(_input, _sums, buffer, _temporaryPath, options).Aggregate();
+        const std::string input = (benchmark == "sum") ? _sorted : (onSums ? _sums : _input);
+        result.bytes = fileBytes(input);
+        result.records = Lines(input);
+        
+        PhaseMeter meter(benchmark);
+        if (benchmark == "pipeline") { //  what main() does by default.
+            TPMMS(_input, _sorted, buffer, _temporaryPath, options).Sort();
+            SumOfCompensationAmounts(_sorted, _sums);
+            TPMMS2(_sums, _ranked, buffer, _temporaryPath, options).Sort();
+        }
+        else if (benchmark == "pass1" || benchmark == "pass2") {
+            TPMMS sorter(_input, _sorted, buffer, _temporaryPath, options);
+            if (benchmark == "pass2") {
+                sorter.Pass1();
+                meter = PhaseMeter(benchmark); //    only the merge is timed.
+                sorter.Pass2();
+            }
+            else {
+                sorter.Pass1();
+                const PhaseReport report = meter.Measure();
+                for (size_t i = 0; i < sorter.temporaryFilesNamesList.size(); ++i) //  nobody will merge the runs.
+                    remove(sorter.temporaryFilesNamesList[i].c_str());
+                return report;
+            }
+        }
+        else if (benchmark == "sum") SumOfCompensationAmounts(_sorted, _sums);
+        else if (benchmark == "fused") TPMMSAggregate(_input, _sums, buffer, _temporaryPath, options).Sort();
+        else if (benchmark == "hash") ClientHashAggregator(_input, _sums, buffer, _temporaryPath, options).Aggregate();
+        else if (benchmark == "rank") TPMMS2(_sums, _ranked, buffer, _temporaryPath, options).Sort();
+        else if (benchmark == "select") CostliestClientsSelector(_sums, _ranked, 10, options).Select();
+        return meter.Measure();
+    }
+    
+    //  Leaves what a crash late in Pass1 would: a manifest, and the runs it lists with the later half of them lost.
+    void Interrupt(const std::string &buffer, const SorterOptions &options) {
+        TPMMS sorter(_input, _sorted, buffer, _temporaryPath, options);
+        sorter.ResumeFromCheckpoint();
+        sorter.Pass1();
+        for (size_t i = sorter.temporaryFilesNamesList.size() / 2; i < sorter.temporaryFilesNamesList.size(); ++i)
+            remove(sorter.temporaryFilesNamesList[i].c_str());
+    }
+    
+    //  The checksum of a file, or of its lines in any order.
+    static uint64_t Checksum(const std::string &fileName, bool unordered) {
+        uint64_t checksum = 0;
+        if (unordered == false) return fileChecksum(fileName, checksum) ? checksum : 0;
+        std::ifstream input(fileName.c_str(), std::ios::in);
+        std::string line;
+        while (std::getline(input, line))
+            checksum += checksumBytes(CHECKSUM_SEED, line.data(), line.size());
+        return checksum;
+    }
+    
+    static std::vector<std::string> splitWords(const std::string &text) {
+        std::vector<std::string> words;
+        std::stringstream stream(text);
+        std::string word;
+        while (stream >> word)
+            words.push_back(word);
+        return words;
+    }
+    
+    std::string _input;
+    std::string _temporaryPath;
+    SorterOptions _options;
+    unsigned int _repeat;
+    std::string _sorted;
+    std::string _sums;
+    std::string _ranked;
+};
+
+std::vector<std::string> splitList(const std::string &list) { //    "1M,8M,64M" -> {"1M", "8M", "64M"}
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (item.empty() == false) items.push_back(item);
+    return items;
+}
+
+int main(int argc, char* argv[]) {
+    ClaimShape shape;
+    std::string input, temporaryPath = ".", csvFile;
+    std::vector<std::string> buffers = splitList("1M,16M,64M");
+    std::vector<std::string> threads = splitList("1,4");
+    std::vector<std::string> benchmarks = splitList("pipeline,pass1,pass2,sum,fused,hash,rank,select");
+    unsigned int repeat = 3;
+    bool generateOnly = false, keep = false, verify = false;
+    SorterOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string flag = argv[i];
+        const bool valued = (i + 1 < argc);
+        if (flag == "--records" && valued) shape.records = strtoull(argv[++i], NULL, 10);
+        else if (flag == "--clients" && valued) shape.clients = strtoull(argv[++i], NULL, 10);
+        else if (flag == "--zipf" && valued) shape.zipf = atof(argv[++i]);
+        else if (flag == "--sorted" && valued) shape.sorted = atof(argv[++i]);
+        else if (flag == "--duplicates" && valued) shape.duplicates = atof(argv[++i]);
+        else if (flag == "--seed" && valued) shape.seed = strtoull(argv[++i], NULL, 10);
+        else if (flag == "--no-final-newline") shape.finalNewline = false;
+        else if (flag == "--input" && valued) input = argv[++i];
+        else if (flag == "--temp" && valued) temporaryPath = argv[++i];
+        else if (flag == "--buffers" && valued) buffers = splitList(argv[++i]);
+        else if (flag == "--threads" && valued) threads = splitList(argv[++i]);
+        else if (flag == "--benchmarks" && valued) benchmarks = splitList(argv[++i]);
+        else if (flag == "--repeat" && valued) repeat = atoi(argv[++i]);
+        else if (flag == "--csv" && valued) csvFile = argv[++i];
+        else if (flag == "--generate-only") generateOnly = true;
+        else if (flag == "--keep") keep = true;
+        else if (flag == "--verify") verify = true;
+        else if (parseSorterOption(argc, argv, i, options)) continue;
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--records N] [--clients N] [--zipf S] [--sorted F] [--duplicates F] [--seed N] [--no-final-newline]"
+            << " [--input FILE] [--temp DIR] [--buffers 1M,16M,...] [--threads 1,4,...] [--benchmarks pipeline,pass1,...]"
+            << " [--repeat N] [--csv FILE] [--generate-only] [--keep] [--verify] [sorter options]" << std::endl;
+            exit(1);
+        }
+    }
+    for (size_t b = 0; b < benchmarks.size(); ++b) {
+        if (Bench::Known(benchmarks[b]) == false) {
+            std::cerr << "Unknown benchmark " << benchmarks[b] << "; choose from pipeline, pass1, pass2, sum, fused, hash, rank and select." << std::endl;
+            exit(1);
+        }
+    }
+    for (size_t b = 0; b < buffers.size(); ++b) {
+        if (parseMemorySize(buffers[b]) == 0) {
+            std::cerr << "Unable to parse buffer size " << buffers[b] << "." << std::endl;
+            exit(1);
+        }
+    }
+    
+    const bool generated = input.empty();
+    if (generated) {
+        input = temporaryPath + "/bench-claims.txt";
+        std::cout << "Generating " << shape.records << " claims of " << shape.clients << " clients (zipf " << shape.zipf
+        << ", sorted " << shape.sorted << ", duplicates " << shape.duplicates << ", seed " << shape.seed << ") into " << input << "..." << std::endl;
+        if (generateClaims(shape, input) == false) exit(1);
+        if (generateOnly) return 0;
+    }
+    
+    if (verify) { //   every mode against the default one, at the first buffer size on one thread.
+        Bench bench(input, temporaryPath, options, 1);
+        const PipelineOutput expected = bench.Outputs("", buffers[0], 1);
+        const uint64_t records = Bench::Lines(input); //   that every mode keeps, the last one too whether or not a newline ends it.
+        const std::vector<std::string> modes = Bench::VerifyModes();
+        unsigned int failures = 0;
+        std::cout << std::left << std::setw(36) << "mode" << std::setw(8) << "buffer" << std::setw(8) << "threads" << "result" << std::endl;
+        for (size_t m = 0; m < modes.size(); ++m) {
+            for (size_t b = 0; b < buffers.size(); ++b) {
+                for (size_t t = 0; t < threads.size(); ++t) {
+                    const PipelineOutput output = bench.Outputs(modes[m], buffers[b], std::max(1, atoi(threads[t].c_str())));
+                    // Hashing groups the clients in no particular order, which reorders the ties of the ranking too.
+                    const bool unordered = (modes[m] == "--aggregate hash");
+                    std::string result;
+                    if (output.sorted != 0 && output.sortedRecords != records) result += " records";
+                    if (output.sorted != 0 && output.sorted != expected.sorted) result += " sorted";
+                    if (unordered ? output.sumsLines != expected.sumsLines : output.sums != expected.sums) result += " sums";
+                    if (unordered ? output.rankedLines != expected.rankedLines : output.ranked != expected.ranked) result += " ranked";
+                    failures += result.empty() ? 0 : 1;
+                    std::cout << std::left << std::setw(36) << (modes[m].empty() ? "default" : modes[m]) << std::setw(8) << buffers[b]
+                    << std::setw(8) << threads[t] << (result.empty() ? "same" : "DIFFERENT:" + result) << std::endl;
+                }
+            }
+        }
+        if (generated && !keep) remove(input.c_str());
+        std::cout << (failures == 0 ? "Every mode wrote the same output." : "Some modes wrote different output.") << std::endl;
+        return (failures == 0) ? 0 : 1;
+    }
+    
+    std::ofstream csv;
+    if (csvFile.empty() == false) {
+        csv.open(csvFile.c_str(), std::ios::out);
+        csv << "benchmark,buffer,threads,input_bytes,input_records,wall_seconds,cpu_seconds,io_wait_seconds,mb_per_second,records_per_second\n";
+    }
+    std::cout << std::left << std::setw(10) << "benchmark" << std::setw(8) << "buffer" << std::setw(8) << "threads"
+    << std::right << std::setw(10) << "seconds" << std::setw(10) << "cpu" << std::setw(10) << "io wait"
+    << std::setw(10) << "MB/s" << std::setw(14) << "records/s" << std::endl;
+    Bench bench(input, temporaryPath, options, repeat);
+    for (size_t b = 0; b < benchmarks.size(); ++b) {
+        for (size_t m = 0; m < buffers.size(); ++m) {
+            for (size_t t = 0; t < threads.size(); ++t) {
+                const BenchResult result = bench.Run(benchmarks[b], buffers[m], std::max(1, atoi(threads[t].c_str())));
+                const double seconds = std::max(result.median.wallSeconds, 1e-9);
+                const double megabytesPerSecond = result.bytes / 1e6 / seconds;
+                const double recordsPerSecond = result.records / seconds;
+                std::cout << std::left << std::setw(10) << result.benchmark << std::setw(8) << result.buffer << std::setw(8) << result.threads
+                << std::right << std::fixed << std::setprecision(3) << std::setw(10) << result.median.wallSeconds
+                << std::setw(10) << result.median.cpuSeconds << std::setw(10) << result.median.ioWaitSeconds
+                << std::setprecision(1) << std::setw(10) << megabytesPerSecond << std::setprecision(0) << std::setw(14) << recordsPerSecond
+                << std::endl;
+                if (csv.is_open())
+                    csv << result.benchmark << "," << result.buffer << "," << result.threads << "," << result.bytes << "," << result.records
+                    << "," << result.median.wallSeconds << "," << result.median.cpuSeconds << "," << result.median.ioWaitSeconds
+                    << "," << megabytesPerSecond << "," << recordsPerSecond << "\n";
+            }
+        }
+    }
+    if (generated && !keep) remove(input.c_str());
+    return 0;
+}
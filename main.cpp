@@ -4,24 +4,69 @@
 
 #include <iostream> // This header is part of the Input/output library.
 #include <string>
+#include <string_view>
 //#include <cstdlib>
 #include <fstream> // This header is also part of the Input/Output library.
-//#include <vector>
+#include <vector>
 //#include <math.h>
 #include <algorithm>
 //#include <stdlib.h>
 #include <string.h>
+#include <stdint.h> // This header provides the fixed-width integer types used for sort keys.
 #include <sstream> // This header is, too, part of the Input/Output library.
-#include <queue> // This header is part of the containers library.
+#include <functional> // This header provides std::less and std::greater.
+#include <deque>
+#include <thread> // These headers are part of the thread support library, used by the Pass1 pipeline.
+#include <mutex>
+#include <condition_variable>
+#include <type_traits> // This header lets run formation pick a radix sort for integer keys at compile time.
+#include <memory>
+#include <atomic> // These headers support the performance report: counters shared between threads, and a wall clock.
+#include <chrono>
+#include <map> // These headers support checkpoints: the runs a manifest lists, and the sorter that wrote them.
+#include <typeinfo>
 //#include <cstdio>
 //#include <stdio.h>
 #include <errno.h>
-//#include <sys/stat.h>
-//#include <sys/types.h>
-//#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h> // This header concerns mmap() and madvise(), used to map the input file.
+#include <fcntl.h>
+#include <unistd.h> // This header concerns the truncate() function.
 #include <libgen.h> // This header concerns the basename() function.
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/syscall.h> // This header concerns syscall(), through which the io_uring engine talks to the kernel.
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define TPMMS_HAVE_IO_URING
+#endif
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+#ifdef TPMMS_WITH_LZ4 // Build with -DTPMMS_WITH_LZ4 -llz4 to compress runs with liblz4 rather than the built-in LZ4 codec.
+#include <lz4.h>
+#endif
+#ifdef TPMMS_WITH_ZSTD // Build with -DTPMMS_WITH_ZSTD -lzstd to offer zstd.
+#include <zstd.h>
+#endif
+
+// Copy the next field of a line of text into a NUL-terminated array, stopping at a newline, as istream::get(field, size) does.
+inline void getField(char* field, size_t size, std::string_view &line) {
+    size_t n = 0;
+    for (; n + 1 < size && n < line.size() && line[n] != '\n'; ++n)
+        field[n] = line[n];
+    memset(field + n, 0, size - n); //  the bytes past the terminator are cleared too, so that run files compress well.
+    line.remove_prefix(n);
+}
+
+// Skip the newline at the end of a record read with istream::get. The last line of a file may lack it, in which case
+// its last field already ran into the end of the file, and ignoring past that would fail the stream and drop the record,
+// which the mapped input, whose last line ends at the end of the file, keeps.
+inline void skipRecordEnd(std::istream &is) {
+    if (!is.eof()) is.ignore(1);
+}
 
 // A Claim record with its attributes is defined as a new data type.
 // This data struct is used for the first pass of the algorithm.
@@ -47,6 +92,7 @@ struct Claim {
     //  overload the >> operator for reading into a Claim record.
     friend std::istream& operator>>(std::istream &is, Claim &Claim)
     {
+        memset(&Claim, 0, sizeof(Claim)); //   no stale bytes from a previous record past the end of a field.
         is.get(Claim.ClaimNumber, 9);
         is.get(Claim.ClaimDate, 11);
         is.get(Claim.clientID, 10);
@@ -56,219 +102,31 @@ struct Claim {
         is.get(Claim.insuredItemID, 3);
         is.get(Claim.damageAmount, 10);
         is.get(Claim.compensationAmount, 11);
-        is.ignore(1); // ignore the whitespace character at the end of each record of input
+        skipRecordEnd(is); // ignore the whitespace character at the end of each record of input
         return is;
     }
-};
-
-//  The datatype struct used by the priority_queue priorityQueue
-struct ClaimForPass2 {
     
-    Claim datum; //  data
-    std::istream* inputStream;
-    bool (*comparisonFunction)(const Claim &c1, const Claim &c2);
-    ClaimForPass2 (const Claim &datum, //    constructor
-                   std::istream* inputStream,
-                   bool (*comparisonFunction)(const Claim &c1, const Claim &c2))
-    :
-    datum(datum),
-    inputStream(inputStream),
-    comparisonFunction(comparisonFunction) {}
-    
-    bool operator < (const ClaimForPass2 &claim) const
+    //  parse a Claim record from one line of text (e.g. a line of a memory-mapped input file), field by field as >> does.
+    void FromText(std::string_view line)
     {
-        // Priority queues try to sort from highest to lowest. Eergo, one needs to negate the final return value.
-        return !(comparisonFunction(datum, claim.datum));
+        getField(ClaimNumber, 9, line);
+        getField(ClaimDate, 11, line);
+        getField(clientID, 10, line);
+        getField(clientName, 26, line);
+        getField(clientAddress, 151, line);
+        getField(clientEmailAddress, 29, line);
+        getField(insuredItemID, 3, line);
+        getField(damageAmount, 10, line);
+        getField(compensationAmount, 11, line);
     }
-};
-
-bool byClientID(Claim const &c1, Claim const &c2) {
-    if (atoi(c1.clientID) < atoi(c2.clientID))  return true;
-    else return false;
-}
-
-struct TPMMS {
-    TPMMS(const std::string &inFile, // constructor, using Claim's overloaded < operator.  Must be defined.
-          const std::string &outFile,
-          const std::string  &maxBufferSize,
-          std::string tempPath,
-          bool (*compareFunction)(const Claim &c1, const Claim &c2) = NULL);
     
-    ~TPMMS(void); //    destructor
-    
-    void Sort(); // Sort the data
-    
-    std::string _inFile;
-    bool (*_compareFunction)(const Claim &c1, const Claim &c2);
-    std::string _tempPath;
-    std::vector<std::string> temporaryFilesNamesList;
-    std::vector<std::ifstream*> temporaryFilesList;
-    std::string _maxBufferSize;
-    unsigned int _chunkCounter;
-    std::string _outFile;
-    void Pass1(); //    drives the creation of sorted sub-files stored on disk.
-    void Pass2(); //    drives the merging of the sorted temp files.
-    void WriteToTempFile(const std::vector<Claim> &lines); //   final, sorted and merged output is written to an output file.
-    void OpenTempFiles();
-    void CloseTemporaryFiles();
-    void SumOfCompensationAmounts();
-    void ShowTopTenCostliestClients();
+    //  where the key fields start within a line of text.
+    static const size_t CLIENT_ID_OFFSET = 8 + 10;
+    static const size_t COMPENSATION_AMOUNT_OFFSET = 8 + 10 + 9 + 25 + 150 + 28 + 2 + 9;
 };
 
-TPMMS::TPMMS (const std::string &inFile, // constructor
-              const std::string &outFile,
-              const std::string  &maxBufferSize,
-              std::string tempPath,
-              bool (*compareFunction)(const Claim &c1, const Claim &c2))
-: _inFile(inFile)
-, _outFile(outFile)
-, _tempPath(tempPath)
-, _maxBufferSize(maxBufferSize)
-, _compareFunction(compareFunction)
-, _chunkCounter(0) {}
-
-TPMMS::~TPMMS(void) {} //   destructor
-
-void TPMMS::Sort() { // API for sorting.
-    Pass1();
-    Pass2();
-}
-
-std::string stl_basename(const std::string &path) { //   STLized version of basename() (because POSIX basename() modifies the input string pointer.)
-    std::string result;
-    char* path_dup = strdup(path.c_str());
-    char* basename_part = basename(path_dup);
-    result = basename_part;
-    free(path_dup);
-    size_t pos = result.find_last_of('.');
-    if (pos != std::string::npos ) // checks whether pos is at the end of the sting or not.
-        result = result.substr(0,pos); // updates the length of result.
-    return result;
-}
-
-void TPMMS::OpenTempFiles() {
-    for (size_t i=0; i < temporaryFilesNamesList.size(); ++i) {
-        std::ifstream* file;
-        file = new std::ifstream(temporaryFilesNamesList[i].c_str(), std::ios::in);
-        if (file->good() == true) {
-            temporaryFilesList.push_back(file); // add a pointer to the opened temp file to the list
-        }
-        else {
-            std::cerr << "Unable to open temp file (" << temporaryFilesNamesList[i]
-            << ").  I suspect a limit on number of open file handles.  Exiting."
-            << std::endl;
-            CloseTemporaryFiles();
-            exit(1);
-        }
-    }
-}
-
-void TPMMS::CloseTemporaryFiles() {
-    for (size_t i=0; i < temporaryFilesList.size(); ++i) { //  delete the pointers to the temp files.
-        temporaryFilesList[i]->close();
-        delete temporaryFilesList[i];
-    }
-    for (size_t i=0; i < temporaryFilesNamesList.size(); ++i) { //  delete the temp files from the file system.
-        remove(temporaryFilesNamesList[i].c_str());  // remove = UNIX "rm"
-    }
-}
-
-void TPMMS::WriteToTempFile(const std::vector<Claim> &buffer) {
-    std::stringstream tempFileSS; //    name the current tempfile
-    if (_tempPath.size() == 0)
-        tempFileSS << _inFile << "." << _chunkCounter;
-    else
-        tempFileSS << _tempPath << "/" << stl_basename(_inFile) << "." << _chunkCounter;
-    std::string temporaryFileName = tempFileSS.str();
-    std::ofstream* output;
-    output = new std::ofstream(temporaryFileName, std::ios::out);
-    for (size_t i = 0; i < buffer.size(); ++i) { // Write the contents of the current buffer to the temporary file.
-        *output << buffer[i] << std::endl;
-    }
-    ++_chunkCounter; //   update the tempFile number and add the tempFile to the list of tempFiles
-    output->close();
-    delete output;
-    temporaryFilesNamesList.push_back(temporaryFileName);
-}
-
-void TPMMS::Pass1() {
-    std::istream* input = new std::ifstream(_inFile.c_str(), std::ios::in);
-    std::vector<Claim> buffer;
-    if (_maxBufferSize == "0") {std::cerr << "Seriously? You want me to do merge sort with a buffer of size 0?" << std::endl; exit(1);}
-    buffer.reserve(stoi(_maxBufferSize));
-    unsigned int totalBytes = 0;  // track the number of bytes consumed so far.
-    Claim record;
-    while (*input >> record) { // keep reading until there is no more input data
-        buffer.push_back(record); //  add the current record to the buffer and
-        //totalBytes += sizeof(line);
-        totalBytes += sizeof(record); //  track the memory used.
-        if (totalBytes > (stoi(_maxBufferSize) * sizeof(record)) - sizeof(record)) { //    sort the buffer and write to a temp file if we have filled up our quota
-            sort(buffer.begin(), buffer.end(), byClientID); //  sort the buffer.
-            WriteToTempFile(buffer); // write the sorted data to a temp file
-            buffer.clear(); //  clear the buffer for the next run
-            totalBytes = 0; // make the totalBytes counter zero in order to count the bytes occupying the buffer again.
-        }
-    }
-    
-    if (buffer.empty() == false) {  //  handle the run (if any) from the last chunk of the input file.
-        sort(buffer.begin(), buffer.end(), byClientID);
-        WriteToTempFile(buffer); // write the sorted data to a temp file
-        buffer.clear();
-    }
-    buffer.shrink_to_fit();
-    std::cout << "Phase 1 completed..." << std::endl;
-}
-
-void TPMMS::Pass2() { //    Merge the sorted temp files.
-    // uses a priority queue, with the values being a pair of the record from the file, and the stream from which the record came
-    // open the sorted temp files up for merging.
-    // loads ifstream pointers into temporaryFilesList
-    std::ostream *output = new std::ofstream(_outFile.c_str(), std::ios::out);
-    OpenTempFiles();
-    
-    //  A priority queue is a container adaptor
-    //  that provides constant time lookup of the largest (by default) element,
-    //  at the expense of logarithmic insertion and extraction.
-    std::priority_queue<ClaimForPass2> priorityQueue; //  priority queue for the buffer.
-    Claim record; //  extract the first record from each temp file
-    for (size_t i = 0; i < temporaryFilesList.size(); ++i) {
-        *temporaryFilesList[i] >> record;
-        priorityQueue.push(ClaimForPass2(record, temporaryFilesList[i], byClientID));
-    }
-    while (priorityQueue.empty() == false) { //  keep working until the queue is empty
-        ClaimForPass2 lowest = priorityQueue.top();  //   grab the lowest element, print it, then ditch it.
-        *output << lowest.datum << std::endl; //    write the entry from the top of the queue
-        priorityQueue.pop(); //  remove this record from the queue
-        *(lowest.inputStream) >> record; //    add the next record from the lowest stream (above) to the queue as long as it's not EOF.
-        if (*(lowest.inputStream))
-            priorityQueue.push( ClaimForPass2(record, lowest.inputStream, byClientID) );
-    }
-    CloseTemporaryFiles();  // Clean up the temporary files.
-    std::cout << "Phase 2 completed...\nGoing to sum compensation amounts..." << std::endl;
-}
-
-void TPMMS::SumOfCompensationAmounts() {
-    std::istream* input  = new std::ifstream(_outFile.c_str(), std::ios::in);
-    std::ofstream SumOfCompensationAmountsFile;
-    SumOfCompensationAmountsFile.open("SumOfCompensationAmountsFile.txt");
-    Claim initialRecord, record;
-    *input >> initialRecord;
-    while (*input >> record) { // keep reading until there is no more input data
-        if (std::string(initialRecord.clientID) == std::string(record.clientID)) {
-            sprintf(initialRecord.compensationAmount, "%.2f", atof(initialRecord.compensationAmount) + atof(record.compensationAmount));
-        }
-        else {
-            SumOfCompensationAmountsFile << initialRecord << std::endl;
-            initialRecord = record;
-        }
-    }
-    SumOfCompensationAmountsFile << initialRecord << std::endl;
-    SumOfCompensationAmountsFile.close();
-    std::cout << "Summed compensation amounts...\n" << std::endl;
-}
-
 // A Claim record with its attributes is defined as a new data type.
-// This data struct is used for the first pass of the algorithm.
+// This data struct is used for the second sort, whose compensation amounts are sums and therefore wider.
 struct Claim2 {
     
     char ClaimNumber[9];
@@ -294,6 +152,7 @@ struct Claim2 {
     //  overload the >> operator for reading into a Claim record.
     friend std::istream& operator>>(std::istream &is, Claim2 &Claim)
     {
+        memset(&Claim, 0, sizeof(Claim)); //   no stale bytes from a previous record past the end of a field.
         is.get(Claim.ClaimNumber, 9);
         is.get(Claim.ClaimDate, 11);
         is.get(Claim.clientID, 10);
@@ -303,221 +162,3497 @@ struct Claim2 {
         is.get(Claim.insuredItemID, 3);
         is.get(Claim.damageAmount, 10);
         is.get(Claim.compensationAmount, 19);
-        is.ignore(1); // ignore the whitespace character at the end of each record of input
+        skipRecordEnd(is); // ignore the whitespace character at the end of each record of input
         return is;
     }
+    
+    //  parse a Claim record from one line of text (e.g. a line of a memory-mapped input file), field by field as >> does.
+    void FromText(std::string_view line)
+    {
+        getField(ClaimNumber, 9, line);
+        getField(ClaimDate, 11, line);
+        getField(clientID, 10, line);
+        getField(clientName, 26, line);
+        getField(clientAddress, 151, line);
+        getField(clientEmailAddress, 29, line);
+        getField(insuredItemID, 3, line);
+        getField(damageAmount, 10, line);
+        getField(compensationAmount, 19, line);
+    }
+    
+    //  where the key fields start within a line of text.
+    static const size_t CLIENT_ID_OFFSET = 8 + 10;
+    static const size_t COMPENSATION_AMOUNT_OFFSET = 8 + 10 + 9 + 25 + 150 + 28 + 2 + 9;
 };
 
-//  the datatype struct used by the priority_queue
-struct ClaimForPass22 {
+// Parse a (possibly space-padded) unsigned decimal field, stopping at the first non-digit.
+inline uint32_t parseDigits(std::string_view field) {
+    size_t i = 0;
+    while (i < field.size() && field[i] == ' ') ++i;
+    uint32_t value = 0;
+    for (; i < field.size() && field[i] >= '0' && field[i] <= '9'; ++i)
+        value = value * 10 + (field[i] - '0');
+    return value;
+}
+
+// Parse a (possibly space-padded, possibly signed) decimal amount such as "0001234.56" into fixed-point cents.
+// Digits past the second decimal place are rounded half away from zero, which matches what "%.2f" prints.
+inline int64_t parseCents(std::string_view field) {
+    size_t i = 0;
+    while (i < field.size() && field[i] == ' ') ++i;
+    bool negative = (i < field.size() && field[i] == '-');
+    if (i < field.size() && (field[i] == '-' || field[i] == '+')) ++i;
+    int64_t cents = 0;
+    for (; i < field.size() && field[i] >= '0' && field[i] <= '9'; ++i)
+        cents = cents * 10 + (field[i] - '0');
+    cents *= 100;
+    if (i < field.size() && field[i] == '.') {
+        ++i;
+        for (int scale = 10; scale > 0 && i < field.size() && field[i] >= '0' && field[i] <= '9'; scale /= 10, ++i)
+            cents += (field[i] - '0') * scale;
+        if (i < field.size() && field[i] >= '5' && field[i] <= '9') ++cents;
+    }
+    return negative ? -cents : cents;
+}
+
+// The field of a line of text that starts at offset, or an empty view if the line is too short.
+inline std::string_view fieldAt(std::string_view line, size_t offset, size_t width) {
+    return offset < line.size() ? line.substr(offset, width) : std::string_view();
+}
+
+// Print an amount in cents as "%.2f" prints the same amount in units.
+inline std::ostream& writeCents(std::ostream &os, int64_t cents) {
+    const uint64_t magnitude = (cents < 0) ? 0 - (uint64_t)cents : (uint64_t)cents;
+    const uint64_t fraction = magnitude % 100;
+    if (cents < 0) os << '-';
+    return os << magnitude / 100 << '.' << (char)('0' + fraction / 10) << (char)('0' + fraction % 10);
+}
+
+// A client's claims folded together: the first of them, and the sum of all of their compensation amounts.
+// This record is read like a Claim and written like a line of SumOfCompensationAmountsFile.txt,
+// so that the first sort can write the sums itself instead of a separate pass summing its output.
+struct ClientTotal {
+    Claim claim;
+    int64_t cents;
+    uint32_t claims;
+    
+    //    write the claim with the summed amount; a lone claim keeps its amount as it was written.
+    friend std::ostream& operator<<(std::ostream &os, const ClientTotal &total)
+    {
+        const Claim &c = total.claim;
+        if (total.claims == 1) return os << c;
+        os << c.ClaimNumber << c.ClaimDate << c.clientID << c.clientName << c.clientAddress << c.clientEmailAddress << c.insuredItemID << c.damageAmount;
+        return writeCents(os, total.cents);
+    }
     
-    Claim2 datum; //  data
-    std::istream* stream;
-    bool (*comparisonFunction)(const Claim2 &c1, const Claim2 &c2);
-    ClaimForPass22 (const Claim2 &datum, //    constructor
-                    std::istream* stream,
-                    bool (*comparisonFunction)(const Claim2 &c1, const Claim2 &c2))
-    :
-    datum(datum),
-    stream(stream),
-    comparisonFunction(comparisonFunction) {}
+    //  read a single claim.
+    friend std::istream& operator>>(std::istream &is, ClientTotal &total)
+    {
+        is >> total.claim;
+        total.Reset();
+        return is;
+    }
     
-    bool operator < (const ClaimForPass22 &c) const
+    void FromText(std::string_view line)
     {
-        //  recall that priority queues try to sort from highest to lowest. thus, we need to negate.
-        return !(comparisonFunction(datum, c.datum));
+        claim.FromText(line);
+        Reset();
+    }
+    
+    void Reset() { //   a total of just this claim.
+        cents = parseCents(claim.compensationAmount);
+        claims = 1;
     }
 };
 
-// Comparison function for sorting by compensationAmount
-bool byCompensationAmount(Claim2 const &c1, Claim2 const &c2) {
-    return (atof(c1.compensationAmount) > atof(c2.compensationAmount));
-}
+// Key extractors turn a record into the value it is sorted on.
+// The key is parsed once, when the record enters the sorter, and stored beside it,
+// so that std::sort in Pass1 and the merge in Pass2 only ever compare integers.
+// The string_view overloads read the key straight out of a line of text, such as a line of a memory-mapped input.
+struct ClientIDKey {
+    typedef uint32_t Key; //   client IDs have nine digits.
+    Key operator()(const Claim &c) const { return parseDigits(c.clientID); }
+    Key operator()(const ClientTotal &t) const { return parseDigits(t.claim.clientID); }
+    Key operator()(std::string_view line) const { return parseDigits(fieldAt(line, Claim::CLIENT_ID_OFFSET, sizeof(Claim::clientID) - 1)); }
+};
 
-struct TPMMS2 {
-    TPMMS2(const std::string &inFile, // constructor, using Claim's overloaded < operator.  Must be defined.
-           const std::string &outFile,
-           const std::string  &maxBufferSize,
-           std::string tempPath,
-           bool (*compareFunction)(const Claim2 &c1, const Claim2 &c2) = NULL);
-    
-    ~TPMMS2(void); //    destructor
+struct CompensationAmountKey {
+    typedef int64_t Key; //  the amount in cents.
+    Key operator()(const Claim2 &c) const { return parseCents(c.compensationAmount); }
+    Key operator()(std::string_view line) const { return parseCents(fieldAt(line, Claim2::COMPENSATION_AMOUNT_OFFSET, sizeof(Claim2::compensationAmount) - 1)); }
+};
+
+// Combiners fold records with equal keys into one while they are sorted: Pass1 folds the records of each run
+// before spilling it, and Pass2 folds what is left while merging. NoCombiner keeps every record.
+struct NoCombiner {
+    static const bool enabled = false;
+    template <typename Record>
+    void operator()(Record &, const Record &) const {}
+};
+
+struct SumCompensationAmounts {
+    static const bool enabled = true;
+    void operator()(ClientTotal &into, const ClientTotal &from) const {
+        into.cents += from.cents;
+        into.claims += from.claims;
+    }
+};
+
+// How Pass1 orders the records of a run before spilling it.
+enum RunSortMethod {
+    AutoSort, //   RadixSort when the key is an integer and the order is std::less or std::greater, DirectSort otherwise.
+    DirectSort, //  merge-sort the keyed records themselves.
+    TagSort, //  sort compact (key, index) tags, then gather the records in that order while writing the run.
+    RadixSort //  like TagSort, but the tags are ordered by an LSD radix sort instead of by comparisons.
+};
+
+// Tells run formation whether Compare orders integer keys in a way an LSD radix sort can reproduce.
+template <typename Key, typename Compare>
+struct RadixOrder {
+    static const bool supported = false;
+    static const bool descending = false;
+};
+
+template <typename Key>
+struct RadixOrder<Key, std::less<Key> > {
+    static const bool supported = std::is_integral<Key>::value;
+    static const bool descending = false;
+};
+
+template <typename Key>
+struct RadixOrder<Key, std::greater<Key> > {
+    static const bool supported = std::is_integral<Key>::value;
+    static const bool descending = true;
+};
+
+// Which engine runs the asynchronous block I/O of the runs and the output.
+enum IOEngine {
+    AutoIO, //  io_uring when the kernel offers it, a thread pool otherwise.
+    UringIO,
+    ThreadPoolIO,
+    SyncIO //  plain blocking pread/pwrite, for comparison.
+};
+
+// How the blocks of a run file are compressed. Runs are mostly space-padded text, which compresses well.
+enum RunCodec {
+    NoRunCodec, //   raw records.
+    LZ4RunCodec, //   the LZ4 block format: liblz4 when built with TPMMS_WITH_LZ4, the built-in codec otherwise.
+    ZstdRunCodec //  zstd at level 1, when built with TPMMS_WITH_ZSTD.
+};
+
+// Tuning knobs shared by every ExternalSorter instantiation. The defaults reproduce the classic algorithm.
+struct SorterOptions {
+    SorterOptions()
+    : runSort(AutoSort)
+    , threads(1)
+    , mapInput(true)
+    , ioEngine(AutoIO)
+    , directIO(false)
+    , replacementSelection(false)
+    , runCodec(NoRunCodec)
+    , checkpoint(false) {}
     
-    void Sort2(); // Sort the data
+    RunSortMethod runSort;
+    unsigned int threads; //  run-formation workers and merge partitions; 1 keeps both passes serial.
+    bool mapInput; //  memory-map inputs whose lines all have the same length instead of reading them through a stream.
+    IOEngine ioEngine;
+    bool directIO; //  open the temporary runs with O_DIRECT, bypassing the page cache.
+    bool replacementSelection; //    form runs with a selection heap rather than by sorting buffer-sized chunks.
+    RunCodec runCodec; //   how the temporary runs are compressed.
+    bool checkpoint; //  keep a manifest of the finished runs, so a rerun after a crash can reuse them.
+};
+
+// A streambuf that only counts the characters written to it; used to measure how wide a record is as text.
+class CountingStreamBuffer : public std::streambuf {
+public:
+    CountingStreamBuffer() : count(0) {}
+    std::streamsize count;
     
-    std::string _inFile;
-    bool (*_compareFunction)(const Claim2 &c1, const Claim2 &c2);
-    std::string _tempPath;
-    std::vector<std::string> temporaryFilesNamesList;
-    std::vector<std::ifstream*> temporaryFilesList;
-    std::string _maxBufferSize;
-    unsigned int _chunkCounter;
-    std::string _outFile;
-    void Pass12(); //    drives the creation of sorted sub-files stored on disk.
-    void Pass22(); //    drives the merging of the sorted temp files.
-    void WriteToTempFile(const std::vector<Claim2> &lines); //   final, sorted and merged output is written to an output file.
-    void OpenTempFiles();
-    void CloseTemporaryFiles();
-    void SumOfCompensationAmounts();
-    void ShowTopTenCostliestClients();
-};
-TPMMS2::TPMMS2 (const std::string &inFile, // constructor
-                const std::string &outFile,
-                const std::string  &maxBufferSize,
-                std::string tempPath,
-                bool (*compareFunction)(const Claim2 &c1, const Claim2 &c2))
-: _inFile(inFile)
-, _outFile(outFile)
-, _tempPath(tempPath)
-, _maxBufferSize(maxBufferSize)
-, _compareFunction(compareFunction)
-, _chunkCounter(0) {}
+protected:
+    int_type overflow(int_type c) {
+        if (c != traits_type::eof()) ++count;
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char*, std::streamsize n) {
+        count += n;
+        return n;
+    }
+};
 
-TPMMS2::~TPMMS2(void) {} //   destructor
+// A loser (tournament) tree for the k-way merge of Pass2. It holds only input indices and the key each input
+// currently offers, so advancing the merge costs a single leaf-to-root replay of about log2(k) comparisons.
+// Equal keys are won by the lower-numbered input, which makes the merge stable and its output unique,
+// so a merge split into key ranges reproduces the serial one byte for byte.
+template <typename Key, typename Compare>
+class LoserTree {
+public:
+    explicit LoserTree(size_t inputs)
+    : _inputs(inputs)
+    , _keys(inputs)
+    , _exhausted(inputs, true)
+    , _tree(std::max<size_t>(inputs, 1), 0)
+    , _comparisons(0) {}
+    
+    void Set(size_t input, const Key &key) { //  offer an input's first key before Build().
+        _keys[input] = key;
+        _exhausted[input] = false;
+    }
+    
+    void Build() { _tree[0] = (_inputs == 0) ? 0 : Play(1); }
+    
+    bool Empty() const { return _inputs == 0 || _exhausted[_tree[0]]; }
+    size_t Winner() const { return _tree[0]; }
+    uint64_t Comparisons() const { return _comparisons; }
+    
+    void Replace(const Key &key) { //  the winner offers its next key.
+        _keys[_tree[0]] = key;
+        Replay(_tree[0]);
+    }
+    
+    void Exhaust() { //  the winner has nothing left to offer.
+        _exhausted[_tree[0]] = true;
+        Replay(_tree[0]);
+    }
+    
+private:
+    bool Beats(size_t a, size_t b) const { //   exhausted inputs lose to everything.
+        if (_exhausted[a] || _exhausted[b]) return !_exhausted[a] && (_exhausted[b] || a < b);
+        ++_comparisons;
+        return _compare(_keys[a], _keys[b]) || (!_compare(_keys[b], _keys[a]) && a < b);
+    }
+    
+    size_t Play(size_t node) { //  plays the subtree rooted at node, storing losers and returning the winner.
+        if (node >= _inputs) return node - _inputs; //  leaves are numbered _inputs .. 2 * _inputs - 1.
+        size_t left = Play(2 * node), right = Play(2 * node + 1);
+        bool leftWins = Beats(left, right);
+        _tree[node] = leftWins ? right : left;
+        return leftWins ? left : right;
+    }
+    
+    void Replay(size_t winner) {
+        for (size_t node = (winner + _inputs) / 2; node > 0; node /= 2) {
+            if (Beats(_tree[node], winner)) std::swap(_tree[node], winner);
+        }
+        _tree[0] = winner;
+    }
+    
+    size_t _inputs;
+    std::vector<Key> _keys;
+    std::vector<char> _exhausted;
+    std::vector<size_t> _tree; //    _tree[0] is the overall winner; _tree[1 .. _inputs - 1] hold the losers.
+    Compare _compare;
+    mutable uint64_t _comparisons; //   for the performance report.
+};
 
-void TPMMS2::Sort2() { // API for sorting.
-    Pass12();
-    Pass22();
+// Drops the pages of a read-only mapping of size bytes that lie wholly within [begin, end), and the last, partial page
+// when the range reaches the end. The mapping must be private: a page that is touched again is read back from the file.
+inline void releaseMappedRange(const char* data, uint64_t size, uint64_t begin, uint64_t end) {
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    begin = (begin + page - 1) / page * page;
+    end = (end >= size) ? (size + page - 1) / page * page : end / page * page;
+    if (begin < end) madvise(const_cast<char*>(data) + begin, end - begin, MADV_DONTNEED);
 }
 
-void TPMMS2::OpenTempFiles() {
-    for (size_t i=0; i < temporaryFilesNamesList.size(); ++i) {
-        std::ifstream* file;
-        file = new std::ifstream(temporaryFilesNamesList[i].c_str(), std::ios::in);
-        if (file->good() == true) {
-            temporaryFilesList.push_back(file); // add a pointer to the opened temp file to the list
+// A read-only memory mapping of a text file whose lines all have the same length (a fixed stride).
+// Pass1 uses it to read the input in place: keys are parsed straight out of the mapping and the run
+// sort orders line numbers, so a record is only copied once, when its run is written.
+class MappedRecordFile {
+public:
+    MappedRecordFile()
+    : _data(NULL)
+    , _size(0)
+    , _stride(0)
+    , _records(0) {}
+    
+    ~MappedRecordFile() {
+        if (_data != NULL) munmap(_data, _size);
+    }
+    
+    //  Maps the file; false (and no mapping) if it is empty, cannot be mapped or its lines differ in length.
+    bool Open(const std::string &fileName) {
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size == 0) {
+            close(fd);
+            return false;
         }
-        else {
-            std::cerr << "Unable to open temp file (" << temporaryFilesNamesList[i]
-            << ").  I suspect a limit on number of open file handles.  Exiting."
-            << std::endl;
-            CloseTemporaryFiles();
-            exit(1);
+        _size = status.st_size;
+        void* data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return false;
+        _data = static_cast<char*>(data);
+        madvise(_data, _size, MADV_SEQUENTIAL); //   the input is read front to back, once.
+        
+        const char* newline = static_cast<const char*>(memchr(_data, '\n', _size));
+        _stride = (newline == NULL) ? 0 : newline - _data + 1;
+        bool fixed = (_stride > 1);
+        if (fixed) { //  the last line may lack its newline.
+            _records = (_size + 1) / _stride;
+            fixed = (_size % _stride == 0) || (_size % _stride == _stride - 1);
+        }
+        // Every line must end exactly one stride after the previous one. The check touches every page,
+        // so it drops them behind itself a megabyte at a time; the runs fault their lines back in as they need them.
+        const uint64_t releaseLines = fixed ? std::max<uint64_t>(1, (1 << 20) / _stride) : 0;
+        uint64_t released = 0;
+        for (uint64_t i = 0; fixed && i < _records; ++i) {
+            uint64_t end = i * _stride + _stride - 1;
+            if (end < _size && _data[end] != '\n') fixed = false;
+            if (i + 1 - released == releaseLines || i + 1 == _records) {
+                Release(released, i + 1 - released);
+                released = i + 1;
+            }
+        }
+        if (!fixed) {
+            munmap(_data, _size);
+            _data = NULL;
+            return false;
         }
+        return true;
     }
-}
+    
+    uint64_t Records() const { return _records; }
+    uint64_t Stride() const { return _stride; }
+    std::string_view Line(uint64_t i) const { //   the i-th line, including its newline.
+        return std::string_view(_data + i * _stride, std::min<uint64_t>(_stride, _size - i * _stride));
+    }
+    
+    //  Drops the pages that hold only lines [first, first + count) once nothing reads them any more, so the mapping
+    //  stays within the memory budget.
+    void Release(uint64_t first, uint64_t count) const {
+        releaseMappedRange(_data, _size, first * _stride, std::min<uint64_t>((first + count) * _stride, _size));
+    }
+    
+private:
+    char* _data;
+    uint64_t _size;
+    uint64_t _stride;
+    uint64_t _records;
+};
 
-void TPMMS2::CloseTemporaryFiles() {
-    for (size_t i=0; i < temporaryFilesList.size(); ++i) { //  delete the pointers to the temp files.
-        temporaryFilesList[i]->close();
-        delete temporaryFilesList[i];
+// A minimal closable FIFO used to hand buffers between the Pass1 pipeline stages.
+template <typename T>
+class BlockingQueue {
+public:
+    BlockingQueue() : _closed(false) {}
+    
+    void Push(const T &item) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _items.push_back(item);
+        _notEmpty.notify_one();
     }
-    for (size_t i=0; i < temporaryFilesNamesList.size(); ++i) { //  delete the temp files from the file system.
-        remove(temporaryFilesNamesList[i].c_str());  // remove = UNIX "rm"
+    
+    bool Pop(T &item) { //  blocks until an item arrives; false once the queue is closed and drained.
+        std::unique_lock<std::mutex> lock(_mutex);
+        _notEmpty.wait(lock, [this]() { return !_items.empty() || _closed; });
+        if (_items.empty())
+            return false;
+        item = _items.front();
+        _items.pop_front();
+        return true;
     }
+    
+    void Close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed = true;
+        _notEmpty.notify_all();
+    }
+    
+private:
+    std::deque<T> _items;
+    std::mutex _mutex;
+    std::condition_variable _notEmpty;
+    bool _closed;
+};
+
+// How many bytes a run file is written in at a time, and the block size of the write-behind output.
+const size_t RUN_IO_BLOCK_BYTES = 1 << 20;
+
+// How many bytes of each run Pass2 reads ahead at a time, unless the merge planner picks a block size from the budget.
+const size_t MERGE_READ_BLOCK_BYTES = 64 * 1024;
+const size_t MAX_MERGE_READ_BLOCK_BYTES = 1 << 20;
+
+// A rough model of the temporary disk, which the merge planner weighs extra merge passes against smaller read blocks with:
+// every pass streams its bytes in and out again, and every block read costs about one seek among the runs.
+const double MERGE_DISK_BYTES_PER_SECOND = 200e6;
+const double MERGE_BLOCK_SECONDS = 1e-4;
+
+// File handles a merge must leave for everything else: the standard streams, the input, the output and a run being written.
+const rlim_t RESERVED_FILE_HANDLES = 16;
+
+// Process-wide counters behind the performance report. Every thread adds to them, in bulk where it can,
+// and a phase is measured by how much they grew while it ran.
+struct PerformanceCounters {
+    std::atomic<uint64_t> bytesRead{0}; //  through the block I/O engines, plus the input files that are mapped or streamed.
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> recordsRead{0};
+    std::atomic<uint64_t> recordsWritten{0};
+    std::atomic<uint64_t> comparisons{0}; //    key comparisons of run formation and merging; a radix sort makes none.
+    std::atomic<uint64_t> ioWaitNanoseconds{0}; //   time spent blocked on the block I/O engines, summed over threads.
+};
+
+inline PerformanceCounters& performanceCounters() {
+    static PerformanceCounters counters;
+    return counters;
 }
 
-void TPMMS2::WriteToTempFile(const std::vector<Claim2> &buffer) {
-    std::stringstream tempFileSS; //    name the current tempfile
-    if (_tempPath.size() == 0)
-        tempFileSS << _inFile << "." << _chunkCounter;
-    else
-        tempFileSS << _tempPath << "/" << stl_basename(_inFile) << "." << _chunkCounter;
-    std::string temporaryFileName = tempFileSS.str();
-    std::ofstream* output;
-    output = new std::ofstream(temporaryFileName, std::ios::out);
-    for (size_t i = 0; i < buffer.size(); ++i) { // write the contents of the current buffer to the temp file
-        *output << buffer[i] << std::endl;
-    }
-    ++_chunkCounter; //   update the tempFile number and add the tempFile to the list of tempFiles
-    output->close();
-    delete output;
-    temporaryFilesNamesList.push_back(temporaryFileName);
-}
-
-void TPMMS2::Pass12() {
-    std::istream* input = new std::ifstream(_inFile.c_str(), std::ios::in);
-    std::vector<Claim2> buffer;
-    if (_maxBufferSize == "0") {std::cerr << "Seriously? You want me to do merge sort with a buffer of size 0?" << std::endl; exit(1);}
-    buffer.reserve(stoi(_maxBufferSize));
-    unsigned int totalBytes = 0;  // track the number of bytes consumed so far.
-    Claim2 record;
-    while (*input >> record) { // keep reading until there is no more input data
-        buffer.push_back(record); //  add the current record to the buffer and
-        //totalBytes += sizeof(line);
-        totalBytes += sizeof(record); //  track the memory used.
-        if (totalBytes > (stoi(_maxBufferSize) * sizeof(record)) - sizeof(record)) { //    sort the buffer and write to a temp file if we have filled up our quota
-            sort(buffer.begin(), buffer.end(), byCompensationAmount); //  sort the buffer.
-            WriteToTempFile(buffer); // write the sorted data to a temp file
-            buffer.clear(); //  clear the buffer for the next run
-            totalBytes = 0; // make the totalBytes counter zero in order to count the bytes occupying the buffer again.
-        }
-    }
-    if (buffer.empty() == false) {  //  handle the run (if any) from the last chunk of the input file.
-        sort(buffer.begin(), buffer.end(), byCompensationAmount);
-        WriteToTempFile(buffer); // write the sorted data to a temp file
-        buffer.clear();
-    }
-    buffer.shrink_to_fit();
-}
-
-void TPMMS2::Pass22() { // Merge the sorted temporary sublists.
-    // Use a priority queue, with the values being a pair of the record from the file, and the stream from which the record came.
-    // Open the sorted temporary sublists for merging.
-    // Load ifstream pointers into temporaryFilesList
-    std::ostream *output = new std::ofstream(_outFile.c_str(), std::ios::out);
-    OpenTempFiles();
-    
-    //  A priority queue is a container adaptor
-    //  That provides constant time lookup of the largest (by default) element,
-    //  At the expense of logarithmic insertion and extraction.
-    std::priority_queue<ClaimForPass22> priorityQueue; //  priority queue for the buffer.
-    Claim2 record; //  extract the first record from each temp file
-    for (size_t i = 0; i < temporaryFilesList.size(); ++i) {
-        *temporaryFilesList[i] >> record;
-        priorityQueue.push(ClaimForPass22(record, temporaryFilesList[i], byCompensationAmount));
-    }
-    while (priorityQueue.empty() == false) { // Keep working until the queue is empty
-        ClaimForPass22 lowest = priorityQueue.top();  // Grab the lowest element, print it, then ditch it.
-        *output << lowest.datum << std::endl; // Write the entry from the top of the queue
-        priorityQueue.pop(); // Remove this record from the queue
-        *(lowest.stream) >> record; // Add the next record from the lowest stream (above) to the queue as long as it's not EOF.
-        if (*(lowest.stream))
-            priorityQueue.push(ClaimForPass22(record, lowest.stream, byCompensationAmount));
-    }
-    CloseTemporaryFiles();  // Clean up the temporary files.
+inline uint64_t fileBytes(const std::string &fileName) { //    0 if the file does not exist.
+    struct stat status;
+    return (stat(fileName.c_str(), &status) == 0) ? status.st_size : 0;
 }
 
-void TPMMS2::ShowTopTenCostliestClients() {
-    const std::string outFile2;
-    std::istream* input = new std::ifstream(_outFile.c_str(), std::ios::in);
-    Claim2 record;
-    std::cout << "Client ID" << "\t" << "Sum of Compensation Amount\n\n";
-    for(unsigned short i = 0; i < 10; i++) {
-        *input >> record;
-        std::cout << record.clientID << "\t" << record.compensationAmount << std::endl;
+inline uint64_t fileModified(const std::string &fileName) { //    nanoseconds since the epoch; 0 if the file does not exist.
+    struct stat status;
+    if (stat(fileName.c_str(), &status) != 0) return 0;
+    return (uint64_t)status.st_mtim.tv_sec * 1000000000 + status.st_mtim.tv_nsec;
+}
+
+inline std::string absolutePath(const std::string &fileName) { //   the canonical path of an existing file; the name as given otherwise.
+    char* resolved = realpath(fileName.c_str(), NULL);
+    if (resolved == NULL) return fileName;
+    const std::string path = resolved;
+    free(resolved);
+    return path;
+}
+
+// Flush a file to the disk, and the directory that names it, so that it survives a crash with its name.
+inline bool syncFile(const std::string &fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool synced = (fsync(fd) == 0);
+    close(fd);
+    char* name = strdup(fileName.c_str());
+    fd = open(dirname(name), O_RDONLY | O_DIRECTORY);
+    free(name);
+    if (fd < 0) return false;
+    synced = (fsync(fd) == 0) && synced;
+    close(fd);
+    return synced;
+}
+
+// A 64-bit checksum in the manner of FNV-1a, but over 8-byte words to keep up with the disk; checkpoints use it
+// to tell a complete run file from a damaged one. It is fed a piece at a time, and every piece but the last
+// must be a multiple of 8 bytes long, so that the words fall in the same places however the file is cut up.
+const uint64_t CHECKSUM_SEED = 14695981039346656037ULL;
+
+inline uint64_t checksumBytes(uint64_t checksum, const void* data, size_t length) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        checksum = (checksum ^ word) * 1099511628211ULL;
+        checksum ^= checksum >> 32; //   the multiply only carries upwards; fold the high half back down.
     }
+    for (; i < length; ++i)
+        checksum = (checksum ^ bytes[i]) * 1099511628211ULL;
+    return checksum;
 }
 
-// A program shall contain a global function named main, which is the designated start of the program.
-int main(int argc, char* argv[]) {
-    int who = RUSAGE_SELF;
-    struct rusage usage;
-    int ret;
-    ret = getrusage(who, &usage);
-    //limit.rlim_max = RLIM_INFINITY; // send SIGKILL after 3 seconds
-    //setrlimit(RUSAGE_SELF, &limit);
-    // This argument is given to the executable pogram via the command line interface.
-    std::string inputFile = argv[1];
+inline bool fileChecksum(const std::string &fileName, uint64_t &checksum) { //    false if the file cannot be read.
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    std::vector<char> block(1024 * 1024);
+    checksum = CHECKSUM_SEED;
+    ssize_t n;
+    while ((n = read(fd, &block[0], block.size())) > 0)
+        checksum = checksumBytes(checksum, &block[0], n);
+    close(fd);
+    performanceCounters().bytesRead += fileBytes(fileName);
+    return n == 0;
+}
+
+// What one phase of the job did: how long it took on the clock and on the processors, how much it moved,
+// and whatever else it has to say about itself (run counts, merge fan-in and so on).
+struct PhaseReport {
+    std::string name;
+    double wallSeconds;
+    double cpuSeconds; //  user and system time of every thread.
+    double ioWaitSeconds;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t recordsRead;
+    uint64_t recordsWritten;
+    uint64_t comparisons;
+    uint64_t peakResidentBytes; //    the peak RSS of the process so far.
+    std::vector<std::pair<std::string, uint64_t> > details;
+    std::vector<uint64_t> runRecords; //    the records and file size of every run the phase left behind.
+    std::vector<uint64_t> runBytes;
+};
+
+// The phases of the job, in the order they finished, written out as JSON at the end of the job.
+// Phases are named after the step of the job that ran them ("claims.pass1", "clients.select").
+class PerformanceReport {
+public:
+    static PerformanceReport& Global() {
+        static PerformanceReport report;
+        return report;
+    }
     
-    // Allow the sorter to use an arbitrary amount (in MegaBytes) of memory for sorting.
-    std::string bufferSize = argv[2];
+    void Step(const std::string &step) { _step = step; }
     
-    // Once the buffer is full, the sorter will dump the buffer's content to a temporary file and grab another chunk from the input file.
-    std::string temporaryPath = argv[3]; // Allows you to write the intermediate files anywhere you want.
+    void Add(PhaseReport phase) {
+        if (_step.empty() == false) phase.name = _step + "." + phase.name;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _phases.push_back(phase);
+    }
     
-    const clock_t BEGINNING = clock(); // Mark the beginning of the execution of the sorting procedure.
-    // Create a new instance of the TPMMS class.
-    TPMMS* firstSorter = new TPMMS (inputFile, "outputFile.txt", bufferSize, temporaryPath, byClientID) ;
-    firstSorter->Sort();
-    firstSorter->SumOfCompensationAmounts();
+    bool Write(const std::string &fileName, const PhaseReport &total) const {
+        std::ofstream output(fileName.c_str(), std::ios::out);
+        output << "{\n  \"phases\": [";
+        for (size_t p = 0; p < _phases.size(); ++p) {
+            output << (p == 0 ? "\n    " : ",\n    ");
+            WritePhase(output, _phases[p]);
+        }
+        output << "\n  ],\n  \"total\": ";
+        WritePhase(output, total);
+        output << "\n}\n";
+        output.close();
+        return !output.fail();
+    }
+    
+private:
+    static void WritePhase(std::ostream &output, const PhaseReport &phase) { //  the names are ours, so they need no escaping.
+        output << "{\"name\": \"" << phase.name << "\""
+        << ", \"wall_seconds\": " << phase.wallSeconds
+        << ", \"cpu_seconds\": " << phase.cpuSeconds
+        << ", \"io_wait_seconds\": " << phase.ioWaitSeconds
+        << ", \"bytes_read\": " << phase.bytesRead
+        << ", \"bytes_written\": " << phase.bytesWritten
+        << ", \"records_read\": " << phase.recordsRead
+        << ", \"records_written\": " << phase.recordsWritten
+        << ", \"comparisons\": " << phase.comparisons
+        << ", \"peak_rss_bytes\": " << phase.peakResidentBytes;
+        for (size_t d = 0; d < phase.details.size(); ++d)
+            output << ", \"" << phase.details[d].first << "\": " << phase.details[d].second;
+        if (phase.runRecords.empty() == false) {
+            WriteList(output, "run_records", phase.runRecords);
+            WriteList(output, "run_bytes", phase.runBytes);
+        }
+        output << "}";
+    }
+    
+    static void WriteList(std::ostream &output, const char* name, const std::vector<uint64_t> &values) {
+        output << ", \"" << name << "\": [";
+        for (size_t i = 0; i < values.size(); ++i)
+            output << (i == 0 ? "" : ", ") << values[i];
+        output << "]";
+    }
+    
+    std::string _step;
+    std::vector<PhaseReport> _phases;
+    std::mutex _mutex;
+};
+
+// Measures a phase from its construction until Finish(), which adds it to the global report.
+class PhaseMeter {
+public:
+    explicit PhaseMeter(const std::string &name)
+    : _start(std::chrono::steady_clock::now())
+    , _cpuStart(CPUSeconds()) {
+        _report.name = name;
+        const PerformanceCounters &counters = performanceCounters();
+        _bytesRead = counters.bytesRead;
+        _bytesWritten = counters.bytesWritten;
+        _recordsRead = counters.recordsRead;
+        _recordsWritten = counters.recordsWritten;
+        _comparisons = counters.comparisons;
+        _ioWaitNanoseconds = counters.ioWaitNanoseconds;
+    }
+    
+    PhaseReport& Report() { return _report; }
+    void Detail(const std::string &name, uint64_t value) { _report.details.push_back(std::make_pair(name, value)); }
+    
+    PhaseReport Measure() const { //   the phase so far.
+        PhaseReport report = _report;
+        const PerformanceCounters &counters = performanceCounters();
+        report.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+        report.cpuSeconds = CPUSeconds() - _cpuStart;
+        report.ioWaitSeconds = (counters.ioWaitNanoseconds - _ioWaitNanoseconds) / 1e9;
+        report.bytesRead = counters.bytesRead - _bytesRead;
+        report.bytesWritten = counters.bytesWritten - _bytesWritten;
+        report.recordsRead = counters.recordsRead - _recordsRead;
+        report.recordsWritten = counters.recordsWritten - _recordsWritten;
+        report.comparisons = counters.comparisons - _comparisons;
+        struct rusage usage;
+        report.peakResidentBytes = (getrusage(RUSAGE_SELF, &usage) == 0) ? (uint64_t)usage.ru_maxrss * 1024 : 0; //   Linux counts it in KiB.
+        return report;
+    }
+    
+    void Finish() { PerformanceReport::Global().Add(Measure()); }
+    
+private:
+    static double CPUSeconds() {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+        return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    }
+    
+    PhaseReport _report;
+    std::chrono::steady_clock::time_point _start;
+    double _cpuStart;
+    uint64_t _bytesRead;
+    uint64_t _bytesWritten;
+    uint64_t _recordsRead;
+    uint64_t _recordsWritten;
+    uint64_t _comparisons;
+    uint64_t _ioWaitNanoseconds;
+};
+
+// One block read or write handed to an AsyncIO engine. The caller owns the request and its buffer
+// and must not touch either until Wait() has returned.
+struct IORequest {
+    IORequest() : fd(-1), buffer(NULL), length(0), offset(0), write(false), result(0), done(true), complete(NULL), context(NULL) {}
+    int fd;
+    char* buffer;
+    size_t length;
+    uint64_t offset;
+    bool write;
+    ssize_t result; //  bytes transferred, or -errno.
+    bool done;
+    struct iovec iov; //  io_uring reads and writes through a single iovec.
+    //  Called as the transfer completes, before Wait() returns, on whichever thread the engine completes it:
+    //  a pool thread, the submitting thread of the synchronous engine, or whoever reaps the io_uring completions.
+    void (*complete)(IORequest &request);
+    void* context;
+};
+
+// Asynchronous block I/O: Submit() starts a request, Wait() blocks until it is complete.
+// An engine is used by one thread at a time; every merge thread and run writer gets its own.
+class AsyncIO {
+public:
+    virtual ~AsyncIO() {}
+    virtual void Submit(IORequest &request) = 0;
+    
+    ssize_t Wait(IORequest &request) {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        WaitFor(request);
+        // Finish a short transfer synchronously; a short read is only expected at the end of the file.
+        while (request.result > 0 && (size_t)request.result < request.length) {
+            ssize_t more = request.write
+                ? pwrite(request.fd, request.buffer + request.result, request.length - request.result, request.offset + request.result)
+                : pread(request.fd, request.buffer + request.result, request.length - request.result, request.offset + request.result);
+            if (more < 0 && errno == EINTR) continue;
+            if (more <= 0) break;
+            request.result += more;
+        }
+        PerformanceCounters &counters = performanceCounters();
+        counters.ioWaitNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        if (request.result > 0) (request.write ? counters.bytesWritten : counters.bytesRead) += request.result;
+        return request.result;
+    }
+    
+    static AsyncIO* Create(IOEngine engine);
+    static unsigned int HandlesFor(IOEngine engine); //   the file handles an engine of that kind keeps open.
+    
+protected:
+    virtual void WaitFor(IORequest &request) = 0;
+    
+    static void Perform(IORequest &request) { //   the blocking transfer behind the synchronous and thread-pool engines.
+        do {
+            request.result = request.write
+                ? pwrite(request.fd, request.buffer, request.length, request.offset)
+                : pread(request.fd, request.buffer, request.length, request.offset);
+        } while (request.result < 0 && errno == EINTR);
+        if (request.result < 0) request.result = -errno;
+    }
+};
+
+class SyncAsyncIO : public AsyncIO {
+public:
+    void Submit(IORequest &request) { //    the caller blocks here rather than in Wait().
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Perform(request);
+        if (request.complete != NULL) request.complete(request);
+        request.done = true;
+        performanceCounters().ioWaitNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
     
-    TPMMS2* secondSorter = new TPMMS2 ("SumOfCompensationAmountsFile.txt", "outputFile2.txt", bufferSize, temporaryPath, byCompensationAmount);
-    secondSorter->Sort2();
+protected:
+    void WaitFor(IORequest &) {}
+};
+
+// The fallback engine: a few threads that perform requests with pread/pwrite, keeping several in flight.
+class ThreadPoolAsyncIO : public AsyncIO {
+public:
+    explicit ThreadPoolAsyncIO(unsigned int threads) {
+        for (unsigned int t = 0; t < threads; ++t) {
+            _threads.push_back(std::thread([this]() {
+                IORequest* request;
+                while (_queue.Pop(request)) {
+                    Perform(*request);
+                    if (request->complete != NULL) request->complete(*request);
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    request->done = true;
+                    _completed.notify_all();
+                }
+            }));
+        }
+    }
+    
+    ~ThreadPoolAsyncIO() {
+        _queue.Close();
+        for (size_t t = 0; t < _threads.size(); ++t)
+            _threads[t].join();
+    }
+    
+    void Submit(IORequest &request) {
+        request.done = false;
+        _queue.Push(&request);
+    }
+    
+protected:
+    void WaitFor(IORequest &request) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _completed.wait(lock, [&request]() { return request.done; });
+    }
+    
+private:
+    BlockingQueue<IORequest*> _queue;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _completed;
+};
+
+#ifdef TPMMS_HAVE_IO_URING
+// An io_uring engine driven through the raw system calls, so it needs no liburing.
+// Reads and writes are queued with IORING_OP_READV/WRITEV, which every io_uring kernel supports.
+class UringAsyncIO : public AsyncIO {
+public:
+    UringAsyncIO()
+    : _fd(-1)
+    , _sqRing(NULL)
+    , _cqRing(NULL)
+    , _sqes(NULL)
+    , _inFlight(0) {}
+    
+    ~UringAsyncIO() {
+        while (_inFlight > 0) Reap(true, false); //   callers wait for their requests, so this only drains the ring.
+        if (_sqes != NULL) munmap(_sqes, _sqesSize);
+        if (_cqRing != NULL && _cqRing != _sqRing) munmap(_cqRing, _cqRingSize);
+        if (_sqRing != NULL) munmap(_sqRing, _sqRingSize);
+        if (_fd >= 0) close(_fd);
+    }
+    
+    bool Init(unsigned int entries) { //   false if the kernel does not offer io_uring.
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        _fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (_fd < 0) return false;
+        _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        const bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMap) _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+        void* sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) return false;
+        _sqRing = static_cast<char*>(sqRing);
+        if (singleMap) _cqRing = _sqRing;
+        else {
+            void* cqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED) return false;
+            _cqRing = static_cast<char*>(cqRing);
+        }
+        _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) return false;
+        _sqes = static_cast<struct io_uring_sqe*>(sqes);
+        _sqTail = reinterpret_cast<unsigned*>(_sqRing + params.sq_off.tail);
+        _sqMask = *reinterpret_cast<unsigned*>(_sqRing + params.sq_off.ring_mask);
+        _sqArray = reinterpret_cast<unsigned*>(_sqRing + params.sq_off.array);
+        _cqHead = reinterpret_cast<unsigned*>(_cqRing + params.cq_off.head);
+        _cqTail = reinterpret_cast<unsigned*>(_cqRing + params.cq_off.tail);
+        _cqMask = *reinterpret_cast<unsigned*>(_cqRing + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<struct io_uring_cqe*>(_cqRing + params.cq_off.cqes);
+        _entries = params.sq_entries;
+        return true;
+    }
+    
+    void Submit(IORequest &request) {
+        while (_inFlight >= _entries) Reap(true); //    never queue more than the completion ring can hold.
+        request.done = false;
+        request.iov.iov_base = request.buffer;
+        request.iov.iov_len = request.length;
+        const unsigned tail = *_sqTail;
+        const unsigned index = tail & _sqMask;
+        struct io_uring_sqe* sqe = &_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = request.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&request.iov);
+        sqe->len = 1;
+        sqe->off = request.offset;
+        sqe->user_data = reinterpret_cast<uint64_t>(&request);
+        _sqArray[index] = index;
+        __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+        ++_inFlight;
+        while (syscall(__NR_io_uring_enter, _fd, 1, 0, 0, NULL, 0) < 0 && errno == EINTR) {}
+    }
+    
+protected:
+    void WaitFor(IORequest &request) {
+        while (!request.done) Reap(true);
+    }
+    
+private:
+    void Reap(bool block, bool complete = true) { //  marks every completed request as done; blocks for one if none has completed.
+        unsigned head = *_cqHead;
+        const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (block) syscall(__NR_io_uring_enter, _fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            return;
+        }
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe &cqe = _cqes[head & _cqMask];
+            if (complete) {
+                IORequest* request = reinterpret_cast<IORequest*>(cqe.user_data);
+                request->result = cqe.res;
+                if (request->complete != NULL) request->complete(*request);
+                request->done = true;
+            }
+            --_inFlight;
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+    
+    int _fd;
+    char* _sqRing;
+    char* _cqRing;
+    size_t _sqRingSize, _cqRingSize, _sqesSize;
+    struct io_uring_sqe* _sqes;
+    struct io_uring_cqe* _cqes;
+    unsigned *_sqTail, *_sqArray, *_cqHead, *_cqTail;
+    unsigned _sqMask, _cqMask, _entries;
+    unsigned _inFlight;
+};
+#endif
+
+AsyncIO* AsyncIO::Create(IOEngine engine) {
+    if (engine == AutoIO || engine == UringIO) {
+#ifdef TPMMS_HAVE_IO_URING
+        UringAsyncIO* uring = new UringAsyncIO;
+        if (uring->Init(64)) return uring;
+        delete uring;
+#endif
+        if (engine == UringIO) std::cerr << "io_uring is not available; falling back to a thread pool." << std::endl;
+    }
+    if (engine == SyncIO) return new SyncAsyncIO;
+    return new ThreadPoolAsyncIO(2);
+}
+
+unsigned int AsyncIO::HandlesFor(IOEngine engine) {
+#ifdef TPMMS_HAVE_IO_URING
+    if (engine == AutoIO || engine == UringIO) return 1; //    the ring itself, if the kernel offers one.
+#endif
+    return 0;
+}
+
+// Buffers handed to O_DIRECT reads and writes must be aligned to the device's logical block size, as must their offsets and lengths.
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// An aligned, heap-allocated byte buffer.
+class AlignedBuffer {
+public:
+    AlignedBuffer() : _data(NULL), _size(0) {}
+    ~AlignedBuffer() { free(_data); }
+    
+    void Allocate(size_t size) {
+        free(_data);
+        _data = NULL;
+        _size = size;
+        if (posix_memalign(reinterpret_cast<void**>(&_data), DIRECT_IO_ALIGNMENT, size) != 0) {
+            std::cerr << "Unable to allocate a " << size << " byte I/O buffer." << std::endl;
+            exit(1);
+        }
+    }
+    
+    char* Data() const { return _data; }
+    size_t Size() const { return _size; }
+    
+private:
+    AlignedBuffer(const AlignedBuffer&);
+    AlignedBuffer& operator=(const AlignedBuffer&);
+    char* _data;
+    size_t _size;
+};
+
+// Opens a file for block I/O, with O_DIRECT if asked to and if the file system allows it.
+inline int openForBlockIO(const std::string &fileName, int flags, bool direct) {
+    int fd = -1;
+    if (direct) fd = open(fileName.c_str(), flags | O_DIRECT, 0644);
+    if (fd < 0) fd = open(fileName.c_str(), flags, 0644); //  e.g. tmpfs refuses O_DIRECT.
+    return fd;
+}
+
+// A write-behind output file: while one block is being written, the caller fills the other.
+// It backs the final output stream of Pass2, so the merge never blocks on a write unless the disk falls behind.
+class AsyncFileBuffer : public std::streambuf {
+public:
+    AsyncFileBuffer(int fd, uint64_t offset, AsyncIO* io, size_t blockBytes = RUN_IO_BLOCK_BYTES)
+    : _fd(fd)
+    , _offset(offset)
+    , _io(io)
+    , _current(0) {
+        _blocks[0].Allocate(blockBytes);
+        _blocks[1].Allocate(blockBytes);
+        setp(_blocks[0].Data(), _blocks[0].Data() + blockBytes);
+    }
+    
+    ~AsyncFileBuffer() { sync(); }
+    
+protected:
+    int_type overflow(int_type c) {
+        if (SubmitCurrent() != 0) return traits_type::eof();
+        if (c != traits_type::eof()) {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+    
+    int sync() { //   writes what is buffered and waits for both blocks.
+        int status = SubmitCurrent();
+        if (WaitBlock(1 - _current) != 0) status = -1;
+        return status;
+    }
+    
+private:
+    int SubmitCurrent() { //  starts writing the current block and switches to the other one.
+        const size_t used = pptr() - pbase();
+        int status = 0;
+        if (used > 0) {
+            IORequest &request = _requests[_current];
+            request.fd = _fd;
+            request.buffer = _blocks[_current].Data();
+            request.length = used;
+            request.offset = _offset;
+            request.write = true;
+            _io->Submit(request);
+            _offset += used;
+        }
+        _current = 1 - _current;
+        if (WaitBlock(_current) != 0) status = -1; //  the other block must be on disk before it is reused.
+        setp(_blocks[_current].Data(), _blocks[_current].Data() + _blocks[_current].Size());
+        return status;
+    }
+    
+    int WaitBlock(int block) {
+        IORequest &request = _requests[block];
+        if (request.length == 0) return 0;
+        ssize_t written = _io->Wait(request);
+        const bool failed = (written < 0 || (size_t)written != request.length);
+        if (failed) std::cerr << "Unable to write output: " << strerror(written < 0 ? -written : EIO) << std::endl;
+        request.length = 0;
+        return failed ? -1 : 0;
+    }
+    
+    int _fd;
+    uint64_t _offset;
+    AsyncIO* _io;
+    AlignedBuffer _blocks[2];
+    IORequest _requests[2];
+    int _current;
+};
+
+// Parses a memory size: a number of megabytes, as bufferSize has always been documented, or a number of bytes
+// with a B, K, M or G suffix ("1048576B", "512K", "64M", "2G"). Returns 0 if the size is malformed.
+inline uint64_t parseMemorySize(const std::string &text) {
+    size_t digits = 0;
+    uint64_t value = 0;
+    for (; digits < text.size() && text[digits] >= '0' && text[digits] <= '9'; ++digits)
+        value = value * 10 + (text[digits] - '0');
+    if (digits == 0 || digits + 1 < text.size()) return 0;
+    const char unit = (digits < text.size()) ? toupper(text[digits]) : 'M';
+    switch (unit) {
+        case 'B': return value;
+        case 'K': return value << 10;
+        case 'M': return value << 20;
+        case 'G': return value << 30;
+        default: return 0;
+    }
+}
+
+// The memory governor: the byte budget that every large buffer of a phase is charged against.
+// A phase first charges its fixed costs (I/O blocks, output buffers), then sizes its record buffers
+// from what is Available() and charges those too, so what is allocated matches what the user gave.
+// Charges are made by the thread that plans a phase, before it hands buffers to other threads.
+class MemoryBudget {
+public:
+    explicit MemoryBudget(uint64_t bytes = 0)
+    : _total(bytes)
+    , _used(0)
+    , _peak(0) {}
+    
+    uint64_t Total() const { return _total; }
+    uint64_t Used() const { return _used; }
+    uint64_t Available() const { return (_used < _total) ? _total - _used : 0; }
+    uint64_t Peak() const { return _peak; }
+    
+    void Charge(uint64_t bytes) {
+        _used += bytes;
+        _peak = std::max(_peak, _used);
+    }
+    
+    void Release(uint64_t bytes) { _used -= std::min(bytes, _used); }
+    
+    //  The I/O block for run writers and output buffers: a sixteenth of the budget, between 4 KiB and RUN_IO_BLOCK_BYTES.
+    size_t WriteBlockBytes() const {
+        const uint64_t block = _total / 16 / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        return (size_t)std::min<uint64_t>(std::max<uint64_t>(block, DIRECT_IO_ALIGNMENT), RUN_IO_BLOCK_BYTES);
+    }
+    
+private:
+    uint64_t _total;
+    uint64_t _used;
+    uint64_t _peak;
+};
+
+// A record together with its pre-parsed sort key. This is also the on-disk layout of a run record:
+// the key is a fixed-size header, so Pass2 never has to parse a record again.
+template <typename Key, typename Record>
+struct KeyedRecord {
+    Key key;
+    Record record;
+};
+
+// The built-in codec writes the LZ4 block format: a sequence of literal runs, each followed by a back-reference
+// of at least four bytes into the previous 64 KiB. It finds matches greedily through a small hash table,
+// which is enough for padded fields and for the repeated names and addresses of consecutive claims.
+inline uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline unsigned char* lz4WriteLength(unsigned char* op, size_t length) { //    the bytes that extend a length past its token's 15.
+    for (; length >= 255; length -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+inline size_t lz4Bound(size_t size) { return size + size / 255 + 16; }
+
+inline size_t lz4Compress(const char* source, size_t size, char* destination) {
+    const int HASH_BITS = 12;
+    uint32_t table[1 << HASH_BITS] = {0}; //  where each hashed 4-byte sequence was last seen.
+    const unsigned char* const base = reinterpret_cast<const unsigned char*>(source);
+    const unsigned char* const end = base + size;
+    const unsigned char* const matchLimit = (size > 5) ? end - 5 : base; //  the last five bytes are always literals,
+    const unsigned char* const startLimit = (size > 12) ? end - 12 : base; //   and the last match starts twelve bytes before the end.
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    unsigned char* op = reinterpret_cast<unsigned char*>(destination);
+    while (ip < startLimit) {
+        const uint32_t sequence = read32(ip);
+        const uint32_t h = (sequence * 2654435761U) >> (32 - HASH_BITS);
+        const unsigned char* match = base + table[h];
+        table[h] = (uint32_t)(ip - base);
+        if (match >= ip || ip - match > 65535 || read32(match) != sequence) {
+            ++ip;
+            continue;
+        }
+        const unsigned char* matchEnd = ip + 4;
+        for (const unsigned char* m = match + 4; matchEnd < matchLimit && *matchEnd == *m; ++matchEnd, ++m) {}
+        const size_t literals = ip - anchor;
+        const size_t matchLength = matchEnd - ip - 4;
+        unsigned char* token = op++;
+        *token = (unsigned char)((std::min<size_t>(literals, 15) << 4) | std::min<size_t>(matchLength, 15));
+        if (literals >= 15) op = lz4WriteLength(op, literals - 15);
+        memcpy(op, anchor, literals);
+        op += literals;
+        const size_t offset = ip - match;
+        *op++ = (unsigned char)(offset & 0xff);
+        *op++ = (unsigned char)(offset >> 8);
+        if (matchLength >= 15) op = lz4WriteLength(op, matchLength - 15);
+        ip = anchor = matchEnd;
+    }
+    const size_t literals = end - anchor; //  the last sequence is literals only.
+    *op++ = (unsigned char)(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15) op = lz4WriteLength(op, literals - 15);
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - reinterpret_cast<unsigned char*>(destination);
+}
+
+// Decompresses exactly size bytes, checking every length and offset against the buffers; false if the block is corrupt.
+inline bool lz4Decompress(const char* source, size_t compressedSize, char* destination, size_t size) {
+    const unsigned char* ip = reinterpret_cast<const unsigned char*>(source);
+    const unsigned char* const inputEnd = ip + compressedSize;
+    char* op = destination;
+    char* const outputEnd = destination + size;
+    while (ip < inputEnd) {
+        const unsigned int token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned char more;
+            do {
+                if (ip >= inputEnd) return false;
+                more = *ip++;
+                literals += more;
+            } while (more == 255);
+        }
+        if (literals > (size_t)(inputEnd - ip) || literals > (size_t)(outputEnd - op)) return false;
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == inputEnd) break; //    the last sequence has no match.
+        if (inputEnd - ip < 2) return false;
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - destination)) return false;
+        size_t matchLength = token & 15;
+        if (matchLength == 15) {
+            unsigned char more;
+            do {
+                if (ip >= inputEnd) return false;
+                more = *ip++;
+                matchLength += more;
+            } while (more == 255);
+        }
+        matchLength += 4;
+        if (matchLength > (size_t)(outputEnd - op)) return false;
+        const char* match = op - offset;
+        if (offset >= matchLength) memcpy(op, match, matchLength);
+        else for (size_t i = 0; i < matchLength; ++i) op[i] = match[i]; //  an overlapping match repeats its last offset bytes.
+        op += matchLength;
+    }
+    return op == outputEnd;
+}
+
+// The largest a block of the given size can grow to when compressed.
+inline size_t compressBound([[maybe_unused]] RunCodec codec, size_t size) { //  unused when only the built-in codec is compiled in.
+#ifdef TPMMS_WITH_ZSTD
+    if (codec == ZstdRunCodec) return ZSTD_compressBound(size);
+#endif
+#ifdef TPMMS_WITH_LZ4
+    if (codec == LZ4RunCodec) return LZ4_compressBound((int)size);
+#endif
+    return lz4Bound(size);
+}
+
+// Compresses a block into destination, which holds compressBound(codec, size) bytes; returns the compressed size.
+inline size_t compressBlock([[maybe_unused]] RunCodec codec, const char* source, size_t size, char* destination) {
+#ifdef TPMMS_WITH_ZSTD
+    if (codec == ZstdRunCodec) {
+        const size_t compressed = ZSTD_compress(destination, ZSTD_compressBound(size), source, size, 1);
+        return ZSTD_isError(compressed) ? size : compressed;
+    }
+#endif
+#ifdef TPMMS_WITH_LZ4
+    if (codec == LZ4RunCodec) return LZ4_compress_default(source, destination, (int)size, LZ4_compressBound((int)size));
+#endif
+    return lz4Compress(source, size, destination);
+}
+
+inline bool decompressBlock(RunCodec codec, const char* source, size_t compressedSize, char* destination, size_t size) {
+#ifdef TPMMS_WITH_ZSTD
+    if (codec == ZstdRunCodec) return ZSTD_decompress(destination, size, source, compressedSize) == size;
+#endif
+#ifdef TPMMS_WITH_LZ4
+    if (codec == LZ4RunCodec) return LZ4_decompress_safe(source, destination, (int)compressedSize, (int)size) == (int)size;
+#endif
+    return codec == LZ4RunCodec && lz4Decompress(source, compressedSize, destination, size);
+}
+
+// Prints how much the compression of the temporary files saved.
+inline void reportCompression(uint64_t rawBytes, uint64_t storedBytes) {
+    std::cout << "Compressed " << rawBytes << " bytes of temporary runs into " << storedBytes << " bytes (ratio "
+    << (storedBytes > 0 ? (double)rawBytes / storedBytes : 0) << ", " << (int64_t)(rawBytes - storedBytes) << " bytes saved)..." << std::endl;
+}
+
+// How many uncompressed bytes of records a compressed run block holds at most; it is also the unit of read-ahead in Pass2.
+const size_t COMPRESSED_BLOCK_BYTES = 64 * 1024;
+
+// A writer with smaller I/O blocks, under a small memory budget, compresses smaller blocks too.
+inline size_t compressedBlockBytes(size_t writeBlockBytes) {
+    return std::min(COMPRESSED_BLOCK_BYTES, std::max<size_t>(writeBlockBytes, DIRECT_IO_ALIGNMENT));
+}
+
+// Marks the end of a run file; the footer is the last sizeof(RunFooter) bytes of the file.
+const uint64_t RUN_FILE_MAGIC = 0x314e5552534d4d50ULL; // "PMMSRUN1"
+
+template <typename Key>
+struct RunFooter {
+    uint64_t magic;
+    uint64_t records;
+    Key minKey; //  the first and last keys of the run, in sort order.
+    Key maxKey;
+    uint32_t codec; //  a RunCodec.
+    uint32_t blockRecords; //    the records in every compressed block but the last.
+    uint64_t indexOffset; //   where the block index of a compressed run starts.
+};
+
+// A compressed run is a sequence of blocks followed by an index of them and the footer.
+// A block that did not shrink is stored raw, with storedBytes equal to its uncompressed size.
+struct RunBlock {
+    uint64_t offset;
+    uint64_t storedBytes;
+};
+
+inline uint64_t alignUp(uint64_t value, uint64_t alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+// Writes a sorted run as raw fixed-size KeyedRecords followed by a RunFooter, or as compressed blocks of them.
+// Records are gathered into blocks of RUN_IO_BLOCK_BYTES; one block is written behind while the next one fills.
+template <typename Key, typename Record>
+class RunFileWriter {
+public:
+    typedef KeyedRecord<Key, Record> Entry;
+    
+    RunFileWriter()
+    : _fd(-1)
+    , _io(NULL)
+    , _direct(false)
+    , _failed(false)
+    , _current(0)
+    , _used(0)
+    , _offset(0)
+    , _fileBytes(0)
+    , _checksummed(false)
+    , _checksum(CHECKSUM_SEED)
+    , _plainUsed(0) {
+        memset(&_footer, 0, sizeof(_footer));
+    }
+    
+    ~RunFileWriter() {
+        if (_fd >= 0) {
+            WaitBlock(0);
+            WaitBlock(1);
+            close(_fd);
+        }
+    }
+    
+    bool Open(const std::string &fileName, AsyncIO* io, bool direct = false, size_t blockBytes = RUN_IO_BLOCK_BYTES,
+              RunCodec codec = NoRunCodec) {
+        _fd = openForBlockIO(fileName, O_WRONLY | O_CREAT | O_TRUNC, direct);
+        if (_fd < 0) return false;
+        _direct = (fcntl(_fd, F_GETFL) & O_DIRECT) != 0;
+        _io = io;
+        blockBytes = alignUp(std::max<size_t>(blockBytes, 1), DIRECT_IO_ALIGNMENT);
+        _blocks[0].Allocate(blockBytes);
+        _blocks[1].Allocate(blockBytes);
+        _footer.magic = RUN_FILE_MAGIC;
+        _footer.records = 0;
+        _footer.codec = codec;
+        if (codec != NoRunCodec) {
+            _footer.blockRecords = std::max<size_t>(1, compressedBlockBytes(blockBytes) / sizeof(Entry));
+            _plain.resize(_footer.blockRecords * sizeof(Entry));
+            _packed.resize(compressBound(codec, _plain.size()));
+        }
+        return true;
+    }
+    
+    void Append(const Entry &entry) {
+        if (_footer.records == 0) _footer.minKey = entry.key;
+        _footer.maxKey = entry.key;
+        ++_footer.records;
+        if (_footer.codec == NoRunCodec) {
+            Put(&entry, sizeof(entry));
+            return;
+        }
+        memcpy(&_plain[_plainUsed], &entry, sizeof(entry));
+        _plainUsed += sizeof(entry);
+        if (_plainUsed == _plain.size()) PutBlock();
+    }
+    
+    bool Close() { //  writes the footer, waits for the writes in flight and closes the file.
+        if (_footer.codec != NoRunCodec) {
+            PutBlock();
+            _footer.indexOffset = _offset + _used;
+            if (_index.empty() == false) Put(&_index[0], _index.size() * sizeof(RunBlock));
+        }
+        Put(&_footer, sizeof(_footer));
+        ChecksumBlock(); //   before any O_DIRECT padding, which is not part of the file.
+        const uint64_t fileSize = _offset + _used;
+        if (_direct && _used > 0) { //   O_DIRECT writes whole aligned blocks; the padding is truncated away below.
+            const size_t padded = alignUp(_used, DIRECT_IO_ALIGNMENT);
+            memset(_blocks[_current].Data() + _used, 0, padded - _used);
+            _used = padded;
+        }
+        SubmitBlock();
+        WaitBlock(0);
+        WaitBlock(1);
+        if (_direct && ftruncate(_fd, fileSize) != 0) _failed = true;
+        if (close(_fd) != 0) _failed = true;
+        _fd = -1;
+        _fileBytes = fileSize;
+        return !_failed;
+    }
+    
+    uint64_t Records() const { return _footer.records; }
+    uint64_t FileBytes() const { return _fileBytes; } //   the size of the closed file.
+    void EnableChecksum() { _checksummed = true; } //   checksum the file as it is written; call before the first Append.
+    uint64_t Checksum() const { return _checksum; } //   the fileChecksum() of the closed file.
+    
+    //  The memory a writer allocates: its two I/O blocks, plus a block of records and its compressed copy when compressing.
+    static uint64_t MemoryFor(size_t blockBytes, RunCodec codec) {
+        uint64_t bytes = 2 * alignUp(std::max<size_t>(blockBytes, 1), DIRECT_IO_ALIGNMENT);
+        if (codec != NoRunCodec) bytes += compressedBlockBytes(blockBytes) + compressBound(codec, compressedBlockBytes(blockBytes));
+        return bytes;
+    }
+    
+private:
+    void PutBlock() { //   compresses the gathered records into the next block of the file.
+        if (_plainUsed == 0) return;
+        RunBlock block;
+        block.offset = _offset + _used;
+        const size_t compressed = compressBlock((RunCodec)_footer.codec, &_plain[0], _plainUsed, &_packed[0]);
+        if (compressed > 0 && compressed < _plainUsed) {
+            block.storedBytes = compressed;
+            Put(&_packed[0], compressed);
+        }
+        else {
+            block.storedBytes = _plainUsed;
+            Put(&_plain[0], _plainUsed);
+        }
+        _index.push_back(block);
+        _plainUsed = 0;
+    }
+    
+    void Put(const void* data, size_t length) {
+        const char* bytes = static_cast<const char*>(data);
+        while (length > 0) {
+            const size_t n = std::min(length, _blocks[_current].Size() - _used);
+            memcpy(_blocks[_current].Data() + _used, bytes, n);
+            _used += n;
+            bytes += n;
+            length -= n;
+            if (_used == _blocks[_current].Size()) {
+                ChecksumBlock();
+                SubmitBlock();
+            }
+        }
+    }
+    
+    void ChecksumBlock() { //    adds what the current block holds to the checksum; blocks are a multiple of 8 bytes long.
+        if (_checksummed) _checksum = checksumBytes(_checksum, _blocks[_current].Data(), _used);
+    }
+    
+    void SubmitBlock() { //   starts writing the current block and switches to the other one.
+        if (_used > 0) {
+            IORequest &request = _requests[_current];
+            request.fd = _fd;
+            request.buffer = _blocks[_current].Data();
+            request.length = _used;
+            request.offset = _offset;
+            request.write = true;
+            _io->Submit(request);
+            _offset += _used;
+        }
+        _current = 1 - _current;
+        WaitBlock(_current); //    the other block must be on disk before it is refilled.
+        _used = 0;
+    }
+    
+    void WaitBlock(int block) {
+        IORequest &request = _requests[block];
+        if (request.length == 0) return;
+        if (_io->Wait(request) != (ssize_t)request.length) _failed = true;
+        request.length = 0;
+    }
+    
+    int _fd;
+    AsyncIO* _io;
+    bool _direct;
+    bool _failed;
+    AlignedBuffer _blocks[2];
+    IORequest _requests[2];
+    int _current;
+    size_t _used; //   bytes of the current block filled so far.
+    uint64_t _offset; //   where the current block goes in the file.
+    uint64_t _fileBytes;
+    bool _checksummed;
+    uint64_t _checksum;
+    RunFooter<Key> _footer;
+    std::vector<char> _plain; //   the records of the compressed block being gathered.
+    size_t _plainUsed;
+    std::vector<char> _packed;
+    std::vector<RunBlock> _index;
+};
+
+// Reads a range of a run file written by RunFileWriter. Two blocks are double-buffered: while the merge
+// consumes one, the next one is already being read. Records stay in their block until the reader moves
+// past them, so a merge can write them out without copying; a record cut by the end of a block is moved
+// in front of the next block, into headroom reserved for it. A compressed run is read ahead a compressed
+// block at a time instead, and each block is decompressed as the merge reaches it.
+template <typename Key, typename Record>
+class RunFileReader {
+public:
+    typedef KeyedRecord<Key, Record> Entry;
+    
+    RunFileReader()
+    : _fd(-1)
+    , _randomFd(-1)
+    , _io(NULL)
+    , _current(0)
+    , _headroom(0)
+    , _position(0)
+    , _rangeEnd(0)
+    , _nextOffset(0)
+    , _cursor(NULL)
+    , _end(NULL)
+    , _nextBlock(0)
+    , _keyBlock(UINT64_MAX) {}
+    
+    ~RunFileReader() {
+        WaitBlock(0);
+        WaitBlock(1);
+        if (_fd >= 0 && _fd != _randomFd) close(_fd);
+        if (_randomFd >= 0) close(_randomFd);
+    }
+    
+    //  Opens the run and checks its footer. count == UINT64_MAX reads from first to the end of the run.
+    bool Open(const std::string &fileName, AsyncIO* io, uint64_t first = 0, uint64_t count = UINT64_MAX,
+              size_t blockBytes = MERGE_READ_BLOCK_BYTES, bool direct = false) {
+        _randomFd = open(fileName.c_str(), O_RDONLY);
+        if (_randomFd < 0) return false;
+        struct stat status;
+        if (fstat(_randomFd, &status) != 0 || (uint64_t)status.st_size < sizeof(_footer)) return false;
+        const uint64_t fileSize = status.st_size;
+        if (pread(_randomFd, &_footer, sizeof(_footer), fileSize - sizeof(_footer)) != (ssize_t)sizeof(_footer)) return false;
+        if (_footer.magic != RUN_FILE_MAGIC || first > _footer.records) return false;
+        if (_footer.codec == NoRunCodec && fileSize != _footer.records * sizeof(Entry) + sizeof(_footer)) return false;
+        if (_footer.codec != NoRunCodec && ReadIndex(fileSize) == false) return false;
+        _fd = direct ? openForBlockIO(fileName, O_RDONLY, true) : _randomFd;
+        if (_fd < 0) return false;
+        _io = io;
+        
+        _headroom = alignUp(sizeof(Entry), DIRECT_IO_ALIGNMENT); //  keeps the block itself aligned for O_DIRECT.
+        if (_footer.codec != NoRunCodec) { //    room for the largest stored block, and for aligning its ends.
+            uint64_t largest = 0;
+            for (size_t b = 0; b < _index.size(); ++b)
+                largest = std::max(largest, _index[b].storedBytes);
+            blockBytes = largest + 2 * DIRECT_IO_ALIGNMENT;
+            _plain[0].resize(_footer.blockRecords * sizeof(Entry));
+            _plain[1].resize(_footer.blockRecords * sizeof(Entry));
+        }
+        blockBytes = alignUp(std::max(blockBytes, sizeof(Entry)), DIRECT_IO_ALIGNMENT);
+        _blocks[0].Allocate(_headroom + blockBytes);
+        _blocks[1].Allocate(_headroom + blockBytes);
+        _position = first * sizeof(Entry);
+        _rangeEnd = (first + std::min(count, _footer.records - first)) * sizeof(Entry);
+        if (_position >= _rangeEnd) return true; //  an empty range.
+        _nextOffset = _position / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+        _nextBlock = first / std::max<uint64_t>(_footer.blockRecords, 1);
+        Prefetch(0);
+        Prefetch(1);
+        _current = 0;
+        Load(0);
+        if (Exhausted()) NextBlock(); //   the first record of the range runs into the second block.
+        return true;
+    }
+    
+    bool Exhausted() const { return _cursor >= _end; }
+    const Entry& Current() const { return *reinterpret_cast<const Entry*>(_cursor); }
+    
+    bool Advance() { //    false once the range is exhausted.
+        _cursor += sizeof(Entry);
+        _position += sizeof(Entry);
+        return _cursor < _end || NextBlock();
+    }
+    
+    const RunFooter<Key>& Footer() const { return _footer; }
+    
+    //  The memory a reader allocates with the given read block: two blocks and their headroom or, for a run
+    //  compressed by a writer with writeBlockBytes, two stored blocks, what they decompress to and the block KeyAt() keeps.
+    static uint64_t MemoryFor(size_t blockBytes, RunCodec codec, size_t writeBlockBytes = RUN_IO_BLOCK_BYTES) {
+        const uint64_t headroom = alignUp(sizeof(Entry), DIRECT_IO_ALIGNMENT);
+        const size_t plain = compressedBlockBytes(writeBlockBytes);
+        if (codec != NoRunCodec)
+            return 2 * (headroom + alignUp(compressBound(codec, plain) + 2 * DIRECT_IO_ALIGNMENT, DIRECT_IO_ALIGNMENT)) + 3 * plain;
+        return 2 * (headroom + alignUp(std::max(blockBytes, sizeof(Entry)), DIRECT_IO_ALIGNMENT));
+    }
+    
+    //  Random access to the key of any record of the run; used to partition runs between merge threads.
+    Key KeyAt(uint64_t index) const {
+        Key key;
+        memset(&key, 0, sizeof(key));
+        if (_footer.codec == NoRunCodec) {
+            if (pread(_randomFd, &key, sizeof(key), index * sizeof(Entry)) != (ssize_t)sizeof(key)) //  the key is the header of each record.
+                memset(&key, 0, sizeof(key));
+            return key;
+        }
+        const uint64_t block = index / _footer.blockRecords;
+        if (block != _keyBlock) { //   decompress the block holding the record, unless it is the last one looked at.
+            std::vector<char> stored(_index[block].storedBytes);
+            _keyPlain.resize(BlockRecords(block) * sizeof(Entry));
+            _keyBlock = UINT64_MAX;
+            if (pread(_randomFd, &stored[0], stored.size(), _index[block].offset) != (ssize_t)stored.size()
+                || Unpack(&stored[0], block, &_keyPlain[0]) == false)
+                return key;
+            _keyBlock = block;
+        }
+        memcpy(&key, &_keyPlain[(index - block * _footer.blockRecords) * sizeof(Entry)], sizeof(key));
+        return key;
+    }
+    
+private:
+    char* BlockData(int block) const { return _blocks[block].Data() + _headroom; }
+    
+    bool ReadIndex(uint64_t fileSize) {
+        if (_footer.blockRecords == 0) return false;
+        const uint64_t blocks = (_footer.records + _footer.blockRecords - 1) / _footer.blockRecords;
+        if (_footer.indexOffset + blocks * sizeof(RunBlock) + sizeof(_footer) != fileSize) return false;
+        _index.resize(blocks);
+        const ssize_t bytes = blocks * sizeof(RunBlock);
+        return blocks == 0 || pread(_randomFd, &_index[0], bytes, _footer.indexOffset) == bytes;
+    }
+    
+    uint64_t BlockRecords(uint64_t block) const {
+        return std::min<uint64_t>(_footer.blockRecords, _footer.records - block * _footer.blockRecords);
+    }
+    
+    bool Unpack(const char* stored, uint64_t block, char* plain) const { //   decompresses one block, or copies it if it is stored raw.
+        const uint64_t size = BlockRecords(block) * sizeof(Entry);
+        if (_index[block].storedBytes == size) {
+            memcpy(plain, stored, size);
+            return true;
+        }
+        return decompressBlock((RunCodec)_footer.codec, stored, _index[block].storedBytes, plain, size);
+    }
+    
+    void Prefetch(int block) { //  starts reading the next block of the file, if the range reaches that far.
+        IORequest &request = _requests[block];
+        request.length = 0;
+        _bytes[block] = 0;
+        request.fd = _fd;
+        request.buffer = BlockData(block);
+        request.write = false;
+        if (_footer.codec != NoRunCodec) { //    the next compressed block, read in whole aligned pages and decompressed as it arrives.
+            if (_nextBlock * _footer.blockRecords * sizeof(Entry) >= _rangeEnd) return;
+            const RunBlock &stored = _index[_nextBlock];
+            request.offset = stored.offset / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+            request.length = alignUp(stored.offset + stored.storedBytes, DIRECT_IO_ALIGNMENT) - request.offset;
+            request.complete = Arrived;
+            request.context = this;
+            _blockOffset[block] = _nextBlock++;
+            _unpacked[block] = false;
+            _io->Submit(request);
+            return;
+        }
+        if (_nextOffset >= _rangeEnd) return;
+        request.length = _blocks[block].Size() - _headroom;
+        request.offset = _nextOffset;
+        _blockOffset[block] = _nextOffset;
+        _nextOffset += request.length;
+        _io->Submit(request);
+    }
+    
+    static void Arrived(IORequest &request) { //  the completion of a compressed read-ahead.
+        RunFileReader* reader = static_cast<RunFileReader*>(request.context);
+        const int block = (&request == &reader->_requests[0]) ? 0 : 1;
+        reader->UnpackBlock(block, request.result);
+    }
+    
+    void UnpackBlock(int block, ssize_t bytes) { //   decompresses a stored block that has been read, if all of it has.
+        const uint64_t index = _blockOffset[block];
+        const RunBlock &stored = _index[index];
+        const uint64_t skip = stored.offset - _requests[block].offset;
+        _unpacked[block] = bytes >= (ssize_t)(skip + stored.storedBytes) && Unpack(BlockData(block) + skip, index, &_plain[block][0]);
+    }
+    
+    void WaitBlock(int block) {
+        IORequest &request = _requests[block];
+        if (request.length == 0) return;
+        ssize_t read = _io->Wait(request);
+        _bytes[block] = (read > 0) ? read : 0;
+        request.length = 0;
+    }
+    
+    void Load(int block) { //   makes the block current; the cursor stays on the record at _position.
+        WaitBlock(block);
+        if (_footer.codec != NoRunCodec) {
+            // The read-ahead decompressed the block when it arrived, unless the read came up short and Wait() finished it.
+            if (_unpacked[block] == false) UnpackBlock(block, _bytes[block]);
+            if (_unpacked[block] == false) {
+                std::cerr << "Unable to read a compressed run block; the run file is corrupt.  Exiting." << std::endl;
+                exit(1);
+            }
+            const uint64_t index = _blockOffset[block];
+            const uint64_t blockStart = index * _footer.blockRecords * sizeof(Entry);
+            const uint64_t blockEnd = std::min(blockStart + BlockRecords(index) * sizeof(Entry), _rangeEnd);
+            _cursor = &_plain[block][0] + (_position - blockStart);
+            _end = &_plain[block][0] + (blockEnd - blockStart);
+            return;
+        }
+        const uint64_t available = std::min(_blockOffset[block] + _bytes[block], _rangeEnd);
+        _cursor = BlockData(block) + (int64_t)(_position - _blockOffset[block]);
+        const uint64_t whole = (available > _position) ? (available - _position) / sizeof(Entry) : 0;
+        _end = _cursor + whole * sizeof(Entry);
+        //  A short read ends the range rather than looping; a full block may just start too close to its end for a whole record.
+        if (whole == 0 && _bytes[block] < _blocks[block].Size() - _headroom) _rangeEnd = _position;
+    }
+    
+    bool NextBlock() {
+        if (_position >= _rangeEnd) return false;
+        const int next = 1 - _current;
+        if (_requests[next].length == 0) { //   nothing was read ahead: the file is shorter than its footer claims.
+            _rangeEnd = _position;
+            _cursor = _end;
+            return false;
+        }
+        if (_footer.codec == NoRunCodec) {
+            WaitBlock(next);
+            const size_t tail = BlockData(_current) + _bytes[_current] - _cursor; //   the start of a record cut by the block's end.
+            memcpy(BlockData(next) - tail, _cursor, tail);
+        }
+        const int previous = _current;
+        _current = next;
+        Load(next);
+        Prefetch(previous); //   the previous block is free again: read ahead into it.
+        return _cursor < _end;
+    }
+    
+    int _fd; //    streams the range, possibly with O_DIRECT.
+    int _randomFd; //   footer and key lookups.
+    AsyncIO* _io;
+    RunFooter<Key> _footer;
+    AlignedBuffer _blocks[2];
+    IORequest _requests[2];
+    uint64_t _blockOffset[2]; //   the file offset of each block's data, or the index of the compressed block it holds.
+    uint64_t _bytes[2]; //    how much of each block was read.
+    int _current;
+    size_t _headroom;
+    uint64_t _position; //  the offset of the current record among the uncompressed records.
+    uint64_t _rangeEnd;
+    uint64_t _nextOffset; //   where the next read-ahead starts.
+    const char* _cursor;
+    const char* _end;
+    std::vector<RunBlock> _index; //  the blocks of a compressed run.
+    uint64_t _nextBlock; //    the next compressed block to read ahead.
+    std::vector<char> _plain[2]; //    each block of a compressed run, decompressed.
+    bool _unpacked[2]; //    whether the read-ahead has decompressed it yet.
+    mutable uint64_t _keyBlock; //   the decompressed block that KeyAt() last looked into.
+    mutable std::vector<char> _keyPlain;
+};
+
+// A generic external sorter (TPMMS) over fixed-layout records.
+// Record must provide the >> and << operators, KeyExtractor maps a Record onto its sort key,
+// and Compare is a strict weak ordering on those keys (e.g. std::less for ascending order).
+// Combiner optionally folds records with equal keys into one, turning the sort into a group-by.
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner = NoCombiner>
+struct ExternalSorter {
+    ExternalSorter(const std::string &inFile, // constructor
+                   const std::string &outFile,
+                   const std::string  &maxBufferSize,
+                   std::string tempPath,
+                   const SorterOptions &options = SorterOptions());
+    
+    ~ExternalSorter(void); //    destructor
+    
+    void Sort(); // Sort the data
+    
+    typedef typename KeyExtractor::Key Key;
+    
+    typedef KeyedRecord<Key, Record> Entry;
+    typedef RunFileReader<Key, Record> RunReader;
+    
+    //  A run-formation tag: the key of a buffered record and its position in the buffer.
+    //  Tags are an order of magnitude smaller than records, so sorting them moves far less memory.
+    struct Tag {
+        Key key;
+        uint32_t index;
+    };
+    
+    //  One run's worth of buffered records plus the scratch space needed to sort them.
+    //  Pass1 keeps several of these in flight when it runs on more than one thread.
+    //  When the input is memory-mapped, a run is a range of its lines and entries stays empty.
+    struct RunBuffer {
+        std::vector<Entry> entries;
+        uint64_t firstLine; //  the run's lines of the mapped input.
+        size_t lines;
+        std::vector<Tag> tags; //  empty unless the run was tag-sorted.
+        std::vector<Tag> radixScratch; //    the other half of the radix sort's ping-pong buffer.
+        std::vector<Entry> mergeScratch; //  half a run, through which a direct sort merges.
+        unsigned int runNumber;
+        uint64_t inputBegin; //    the bytes of the input the run was read from.
+        uint64_t inputEnd;
+        size_t Size() const { return entries.empty() ? lines : entries.size(); }
+    };
+    
+    //  What Pass2 needs to know about a run written by Pass1.
+    struct RunInfo {
+        RunInfo() : records(0), fileBytes(0), textWidth(0), inputBegin(0), inputEnd(0), checksum(0) {}
+        std::string fileName;
+        uint64_t records;
+        uint64_t fileBytes;
+        uint64_t textWidth; // the length of every output line of the run, or 0 if unknown or if the lines differ in length.
+        uint64_t inputBegin; //    the bytes of the input the run holds the records of; a merged run spans its inputs' ranges.
+        uint64_t inputEnd;
+        uint64_t checksum; //  of the run file, when checkpointing.
+    };
+    
+    //  Writes one sorted run to its temp file and records it in _runs. With a combiner, equal keys are folded
+    //  into their first record before they reach the disk.
+    class RunOutput {
+    public:
+        RunOutput(ExternalSorter &sorter, unsigned int runNumber, AsyncIO* io)
+        : _sorter(sorter)
+        , _runNumber(runNumber)
+        , _folding(false)
+        // Only a parallel merge needs to know how wide the output lines are, so only measure them for one.
+        // Combined records are merged serially, because their output lines cannot be counted ahead.
+        , _measure(sorter._options.threads > 1 && !Combiner::enabled)
+        , _width(&_widthBuffer) {
+            _run.fileName = sorter.TemporaryFileName(runNumber);
+            if (_file.Open(_run.fileName, io, sorter._options.directIO, sorter._writeBlockBytes, sorter._options.runCodec) == false) {
+                std::cerr << "Unable to create temp file (" << _run.fileName << "): " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            if (sorter._options.checkpoint) _file.EnableChecksum();
+            sorter.CheckpointStart(runNumber, _run.fileName);
+        }
+        
+        void SetInputRange(uint64_t begin, uint64_t end) { //    which bytes of the input the run covers, for the checkpoint.
+            _run.inputBegin = begin;
+            _run.inputEnd = end;
+        }
+        
+        void Append(const Entry &entry) { //  entries must arrive in sort order.
+            if constexpr (Combiner::enabled) {
+                if (_folding && !_sorter._compare(_folded.key, entry.key) && !_sorter._compare(entry.key, _folded.key)) {
+                    _sorter._combine(_folded.record, entry.record);
+                    return;
+                }
+                if (_folding) Write(_folded);
+                _folded = entry;
+                _folding = true;
+            }
+            else
+                Write(entry);
+        }
+        
+        void Close() {
+            if (_folding) Write(_folded);
+            _folding = false;
+            _run.records = _file.Records();
+            if (_file.Close() == false) {
+                std::cerr << "Unable to write temp file (" << _run.fileName << "): " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            if (!_measure) _run.textWidth = 0;
+            _run.fileBytes = _file.FileBytes();
+            _run.checksum = _file.Checksum();
+            _sorter._runBytes += _run.records * sizeof(Entry);
+            _sorter._runFileBytes += _run.fileBytes;
+            performanceCounters().recordsWritten += _run.records;
+            if (_sorter._runs.size() <= _runNumber) _sorter._runs.resize(_runNumber + 1);
+            _sorter._runs[_runNumber] = _run;
+            _sorter.CheckpointRun(_runNumber, _run);
+        }
+        
+    private:
+        void Write(const Entry &entry) {
+            _file.Append(entry);
+            if (_measure) {
+                _widthBuffer.count = 0;
+                _width << entry.record;
+                const uint64_t lineLength = _widthBuffer.count + 1;
+                if (_file.Records() == 1) _run.textWidth = lineLength;
+                else if (_run.textWidth != lineLength) _measure = false;
+            }
+        }
+        
+        ExternalSorter &_sorter;
+        unsigned int _runNumber;
+        RunInfo _run;
+        RunFileWriter<Key, Record> _file;
+        Entry _folded; //    the record that equal keys are being combined into.
+        bool _folding;
+        bool _measure;
+        CountingStreamBuffer _widthBuffer;
+        std::ostream _width;
+    };
+    
+    std::string _inFile;
+    KeyExtractor _keyOf;
+    Compare _compare;
+    Combiner _combine;
+    std::string _tempPath;
+    std::vector<std::string> temporaryFilesNamesList;
+    std::vector<RunReader*> temporaryFilesList;
+    std::vector<RunInfo> _runs; //   indexed by run number; only touched by whichever thread writes the runs.
+    MemoryBudget _memory; //    bufferSize, in bytes.
+    size_t _writeBlockBytes; //   the I/O block of run writers and of the output.
+    unsigned int _chunkCounter;
+    std::string _outFile;
+    SorterOptions _options;
+    const MappedRecordFile* _mapped; //   the input mapping during Pass1, or NULL when the input is read through a stream.
+    uint64_t _nextLine; //  the first mapped line not yet handed to a run.
+    uint64_t _runBytes; //    the records written to temporary runs, and the bytes they took on disk.
+    uint64_t _runFileBytes;
+    uint64_t _mergeBudget; //   the bytes Pass2 may spend on read blocks.
+    size_t _mergeBlockBytes; //    the read block of every run in the final merge.
+    size_t _fanIn; //   the widest merge PlanMerge chose, and how many merges it made ahead of the final one.
+    unsigned int _intermediateMerges;
+    std::string _manifestFile; //    the checkpoint manifest, when checkpointing.
+    int _manifest; //    the manifest, open for appending, or -1 while runs are not being recorded.
+    bool _holdRuns; //  finished runs are not recorded yet, though the files they are written to are.
+    uint64_t _inputBytes;
+    uint64_t _resumeOffset; //    how much of the input the reused runs of an interrupted sort already cover.
+    unsigned int _resumedRuns;
+    void Pass1(); //    drives the creation of sorted sub-files stored on disk.
+    void Pass2(); //    drives the merging of the sorted temp files.
+    void ReserveRunBuffer(RunBuffer &buffer, size_t capacity);
+    bool FillRunBuffer(std::istream &input, RunBuffer &buffer, size_t capacity); //   reads the next run; false at the end of the input.
+    void SortRun(RunBuffer &buffer); //  sorts a full buffer, either directly or through its tags.
+    void RadixSortTags(RunBuffer &buffer); //  stable LSD radix sort of the buffer's tags by key.
+    bool SortsDirectly() const; //  whether runs are sorted as whole records rather than through tags.
+    void MergeSortEntries(RunBuffer &buffer); //  stable merge sort of the buffer's records.
+    std::string TemporaryFileName(unsigned int runNumber) const;
+    void WriteToTempFile(const RunBuffer &buffer, AsyncIO* io); //   writes a sorted run, gathering through the tags when tag-sorted.
+    bool ReadEntry(std::istream &input, Entry &entry); //  reads the next input record and its key; false at the end of the input.
+    void ReplacementSelection(std::istream &input, uint64_t bytes); //    forms runs through a selection heap instead of sorted buffers.
+    void MergeRange(std::vector<RunReader*> &inputs, std::ostream &output); //  k-way merges what remains of every input.
+    bool ParallelMerge(uint64_t textWidth); //  merges key ranges of the runs on separate threads; false if one of them failed.
+    uint64_t ReaderHandles(bool parallel) const; //  the file handles left for run readers by RLIMIT_NOFILE.
+    size_t ReadBlockBytes(size_t readers) const; //  the largest read block with which that many run readers fit the merge budget.
+    static size_t ChooseWindow(const std::vector<uint64_t> &sizes, size_t width); //  the adjacent runs with the fewest bytes.
+    double MergeCost(std::vector<uint64_t> sizes, size_t fanIn, size_t readersPerRun, unsigned int &merges) const;
+    void PlanMerge(bool parallel, AsyncIO* io); //   merges runs ahead of the final merge until few enough are left.
+    void MergeRuns(size_t first, size_t count, size_t blockBytes, AsyncIO* io); //  merges adjacent runs into one new run.
+    void OpenTempFiles(AsyncIO* io);
+    void CloseTemporaryFiles();
+    uint64_t InputPosition(std::istream &input) const; //   how many bytes of the input Pass1 has consumed.
+    std::string CheckpointFileName() const;
+    bool ResumeFromCheckpoint(); //    reuses the runs an interrupted sort left behind; true if its output is already complete.
+    void WriteCheckpoint(const std::string &line, bool durable = true); //  appends a line to the manifest, and syncs it if durable.
+    void CheckpointStart(unsigned int runNumber, const std::string &fileName); //    records a run file as it is created.
+    void CheckpointRun(unsigned int runNumber, const RunInfo &run); //  records a finished run in the manifest.
+    std::string CheckpointLine(unsigned int runNumber, const RunInfo &run) const;
+    void FinishCheckpoint(); //    records the completed output in the manifest.
+};
+
+// The first sort groups the claims by client; the second one ranks the clients by their total compensation.
+typedef ExternalSorter<Claim, ClientIDKey, std::less<ClientIDKey::Key> > TPMMS;
+typedef ExternalSorter<Claim2, CompensationAmountKey, std::greater<CompensationAmountKey::Key> > TPMMS2;
+// Groups the claims by client and sums their compensation amounts as it sorts them.
+typedef ExternalSorter<ClientTotal, ClientIDKey, std::less<ClientIDKey::Key>, SumCompensationAmounts> TPMMSAggregate;
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ExternalSorter (const std::string &inFile, // constructor
+                                                               const std::string &outFile,
+                                                               const std::string  &maxBufferSize,
+                                                               std::string tempPath,
+                                                               const SorterOptions &options)
+: _inFile(inFile)
+, _tempPath(tempPath)
+, _memory(parseMemorySize(maxBufferSize))
+, _writeBlockBytes(_memory.WriteBlockBytes())
+, _chunkCounter(0)
+, _outFile(outFile)
+, _options(options)
+, _mapped(NULL)
+, _nextLine(0)
+, _runBytes(0)
+, _runFileBytes(0)
+, _mergeBudget(0)
+, _mergeBlockBytes(MERGE_READ_BLOCK_BYTES)
+, _fanIn(0)
+, _intermediateMerges(0)
+, _manifest(-1)
+, _holdRuns(false)
+, _inputBytes(0)
+, _resumeOffset(0)
+, _resumedRuns(0) {}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+ExternalSorter<Record, KeyExtractor, Compare, Combiner>::~ExternalSorter(void) { //   destructor
+    if (_manifest >= 0) close(_manifest);
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::Sort() { // API for sorting.
+    if (_options.checkpoint && ResumeFromCheckpoint()) {
+        std::cout << "Reusing " << _outFile << ", which an earlier run already sorted " << _inFile << " into..." << std::endl;
+        return;
+    }
+    Pass1();
+    Pass2();
+    if (_options.checkpoint) FinishCheckpoint();
+    if (_options.runCodec != NoRunCodec) reportCompression(_runBytes, _runFileBytes);
+    std::cout << "Accounted for a peak of " << _memory.Peak() << " of " << _memory.Total() << " budgeted bytes..." << std::endl;
+}
+
+std::string stl_basename(const std::string &path) { //   STLized version of basename() (because POSIX basename() modifies the input string pointer.)
+    std::string result;
+    char* path_dup = strdup(path.c_str());
+    char* basename_part = basename(path_dup);
+    result = basename_part;
+    free(path_dup);
+    size_t pos = result.find_last_of('.');
+    if (pos != std::string::npos ) // checks whether pos is at the end of the sting or not.
+        result = result.substr(0,pos); // updates the length of result.
+    return result;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::OpenTempFiles(AsyncIO* io) {
+    for (size_t i=0; i < temporaryFilesNamesList.size(); ++i) {
+        RunReader* file = new RunReader;
+        if (file->Open(temporaryFilesNamesList[i], io, 0, UINT64_MAX, _mergeBlockBytes, _options.directIO) == true) {
+            temporaryFilesList.push_back(file); // add a pointer to the opened temp file to the list
+        }
+        else {
+            delete file;
+            std::cerr << "Unable to open temp file (" << temporaryFilesNamesList[i]
+            << ").  It is not a complete run file.  Exiting."
+            << std::endl;
+            CloseTemporaryFiles();
+            exit(1);
+        }
+    }
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::CloseTemporaryFiles() {
+    for (size_t i=0; i < temporaryFilesList.size(); ++i) //  delete the pointers to the temp files.
+        delete temporaryFilesList[i];
+    temporaryFilesList.clear();
+    for (size_t i=0; i < temporaryFilesNamesList.size(); ++i) { //  delete the temp files from the file system.
+        remove(temporaryFilesNamesList[i].c_str());  // remove = UNIX "rm"
+    }
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+std::string ExternalSorter<Record, KeyExtractor, Compare, Combiner>::TemporaryFileName(unsigned int runNumber) const {
+    std::stringstream tempFileSS; //    name the current tempfile
+    if (_tempPath.size() == 0)
+        tempFileSS << _inFile << "." << runNumber;
+    else
+        tempFileSS << _tempPath << "/" << stl_basename(_inFile) << "." << runNumber;
+    return tempFileSS.str();
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+uint64_t ExternalSorter<Record, KeyExtractor, Compare, Combiner>::InputPosition(std::istream &input) const {
+    if (_mapped != NULL) return std::min<uint64_t>(_nextLine * _mapped->Stride(), _inputBytes);
+    if (input.good() == false) return _inputBytes; //    the stream only fails once it has read everything.
+    return (uint64_t)input.tellg();
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+std::string ExternalSorter<Record, KeyExtractor, Compare, Combiner>::CheckpointFileName() const {
+    std::stringstream manifestSS; //   the manifest sits next to the runs it lists.
+    if (_tempPath.size() == 0)
+        manifestSS << _inFile << ".manifest";
+    else
+        manifestSS << _tempPath << "/" << stl_basename(_inFile) << ".manifest";
+    return manifestSS.str();
+}
+
+// The manifest is a text file: a header naming the sorter and the input it sorts, a line for every run file
+// as it is created and another as it is finished, whether by Pass1 or by an intermediate merge, and a last line
+// once the output is complete:
+//
+//      TPMMS checkpoint 2
+//      sorter <type of the sorter>
+//      input <bytes> <modified> <file>
+//      begin <number> <file>
+//      run <number> <input begin> <input end> <records> <bytes> <checksum> <text width> <file>
+//      done <bytes> <modified> <file>
+//
+// Files are named by their canonical paths, so a rerun from another directory finds them, and each is synced
+// to the disk before the line that finishes it. A merged run spans the input ranges of the runs it was merged from
+// and supersedes them. The runs that are still complete and cover the input from its first byte, without a gap,
+// are reused; Pass1 carries on after them. Every other file the manifest names is deleted, including runs a crash
+// left half written, but nothing else in the temp directory is touched.
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+bool ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ResumeFromCheckpoint() {
+    _manifestFile = CheckpointFileName();
+    _inputBytes = fileBytes(_inFile);
+    std::stringstream header;
+    header << "TPMMS checkpoint 2\n"
+    << "sorter " << typeid(ExternalSorter).name() << "\n"
+    << "input " << _inputBytes << " " << fileModified(_inFile) << " " << absolutePath(_inFile) << "\n";
+    
+    std::ifstream manifest(_manifestFile.c_str(), std::ios::in);
+    std::string line, headerLines;
+    for (int i = 0; i < 3 && std::getline(manifest, line); ++i)
+        headerLines += line + "\n";
+    const bool sameInput = (headerLines == header.str()); //  a different input, or another sorter's runs, start over.
+    std::map<uint64_t, std::pair<unsigned int, RunInfo> > runs; //    by the input offset they start at.
+    std::vector<std::string> stale; //   run files that nothing will read again.
+    std::vector<std::string> begun; //  every run file the manifest says was created.
+    bool done = false;
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "run") {
+            unsigned int number;
+            RunInfo run;
+            fields >> number >> run.inputBegin >> run.inputEnd >> run.records >> run.fileBytes >> run.checksum >> run.textWidth;
+            fields.ignore(1);
+            std::getline(fields, run.fileName);
+            if (!fields || run.inputBegin >= run.inputEnd) continue; //    a line the crash cut short.
+            while (true) { //    drop the runs it was merged from.
+                typename std::map<uint64_t, std::pair<unsigned int, RunInfo> >::iterator covered = runs.lower_bound(run.inputBegin);
+                if (covered == runs.end() || covered->first >= run.inputEnd) break;
+                stale.push_back(covered->second.second.fileName);
+                runs.erase(covered);
+            }
+            runs[run.inputBegin] = std::make_pair(number, run);
+        }
+        else if (kind == "begin") {
+            unsigned int number;
+            std::string fileName;
+            fields >> number;
+            fields.ignore(1);
+            std::getline(fields, fileName);
+            if (fields) begun.push_back(fileName);
+        }
+        else if (kind == "done") {
+            uint64_t bytes, modified;
+            std::string outFile;
+            fields >> bytes >> modified;
+            fields.ignore(1);
+            std::getline(fields, outFile);
+            done = fields && outFile == absolutePath(_outFile) && bytes == fileBytes(_outFile) && modified == fileModified(_outFile);
+        }
+    }
+    manifest.close();
+    if (sameInput && done) return true;
+    
+    std::vector<unsigned int> numbers; //    of the runs that are kept.
+    bool covering = sameInput;
+    for (typename std::map<uint64_t, std::pair<unsigned int, RunInfo> >::iterator it = runs.begin(); it != runs.end(); ++it) {
+        const RunInfo &run = it->second.second;
+        uint64_t checksum = 0;
+        covering = covering && run.inputBegin == _resumeOffset && fileBytes(run.fileName) == run.fileBytes
+        && fileChecksum(run.fileName, checksum) && checksum == run.checksum;
+        if (covering) {
+            _runs.push_back(run);
+            numbers.push_back(it->second.first);
+            _resumeOffset = run.inputEnd;
+        }
+        else //    the first gap or damaged run ends the part of the input that is covered.
+            stale.push_back(run.fileName);
+    }
+    // Replacement selection spreads the input over its runs, so only a complete Pass1 of it can be reused.
+    if (_options.replacementSelection && _resumeOffset < _inputBytes) {
+        for (size_t r = 0; r < _runs.size(); ++r)
+            stale.push_back(_runs[r].fileName);
+        _runs.clear();
+        numbers.clear();
+        _resumeOffset = 0;
+    }
+    for (size_t b = 0; b < begun.size(); ++b) { //    runs that were never finished, or whose lines were lost.
+        bool kept = false;
+        for (size_t r = 0; r < _runs.size() && !kept; ++r)
+            kept = (_runs[r].fileName == begun[b]);
+        if (!kept) stale.push_back(begun[b]);
+    }
+    for (size_t i = 0; i < stale.size(); ++i)
+        remove(stale[i].c_str());
+    
+    // Start a new manifest with the runs that are kept, and swap it in whole.
+    const std::string fresh = _manifestFile + ".new";
+    {
+        std::ofstream output(fresh.c_str(), std::ios::out | std::ios::trunc);
+        output << header.str();
+        for (size_t r = 0; r < _runs.size(); ++r)
+            output << CheckpointLine(numbers[r], _runs[r]);
+        output.close();
+        if (!output || !syncFile(fresh) || rename(fresh.c_str(), _manifestFile.c_str()) != 0 || !syncFile(_manifestFile)) {
+            std::cerr << "Unable to write the checkpoint manifest (" << _manifestFile << "): " << strerror(errno) << std::endl;
+            exit(1);
+        }
+    }
+    _manifest = open(_manifestFile.c_str(), O_WRONLY | O_APPEND);
+    if (_manifest < 0) {
+        std::cerr << "Unable to open the checkpoint manifest (" << _manifestFile << "): " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    _resumedRuns = _runs.size();
+    for (size_t r = 0; r < _runs.size(); ++r) { //    new runs are numbered after the reused ones.
+        _chunkCounter = std::max(_chunkCounter, numbers[r] + 1);
+        _runBytes += _runs[r].records * sizeof(Entry);
+        _runFileBytes += _runs[r].fileBytes;
+    }
+    if (_resumedRuns > 0)
+        std::cout << "Reusing " << _resumedRuns << " runs that cover " << _resumeOffset << " of " << _inputBytes << " input bytes..." << std::endl;
+    return false;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::WriteCheckpoint(const std::string &line, bool durable) {
+    if (write(_manifest, line.data(), line.size()) != (ssize_t)line.size() || (durable && fdatasync(_manifest) != 0)) {
+        std::cerr << "Unable to write the checkpoint manifest (" << _manifestFile << "): " << strerror(errno) << std::endl;
+        exit(1);
+    }
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::CheckpointStart(unsigned int runNumber, const std::string &fileName) {
+    // Not synced: a crash that loses the line can only leave the file behind, never delete someone else's.
+    if (_manifest >= 0) WriteCheckpoint("begin " + std::to_string(runNumber) + " " + absolutePath(fileName) + "\n", false);
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::CheckpointRun(unsigned int runNumber, const RunInfo &run) {
+    if (_manifest < 0 || _holdRuns) return;
+    if (syncFile(run.fileName) == false) { //    the run must be on the disk before the manifest says it is.
+        std::cerr << "Unable to sync temp file (" << run.fileName << "): " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    WriteCheckpoint(CheckpointLine(runNumber, run));
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+std::string ExternalSorter<Record, KeyExtractor, Compare, Combiner>::CheckpointLine(unsigned int runNumber, const RunInfo &run) const {
+    std::stringstream line;
+    line << "run " << runNumber << " " << run.inputBegin << " " << run.inputEnd << " " << run.records << " "
+    << run.fileBytes << " " << run.checksum << " " << run.textWidth << " " << absolutePath(run.fileName) << "\n";
+    return line.str();
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::FinishCheckpoint() {
+    if (syncFile(_outFile) == false) {
+        std::cerr << "Unable to sync output file (" << _outFile << "): " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    std::stringstream line; //   the runs are gone; a rerun can take the output as it is, as long as nobody has touched it.
+    line << "done " << fileBytes(_outFile) << " " << fileModified(_outFile) << " " << absolutePath(_outFile) << "\n";
+    WriteCheckpoint(line.str());
+    close(_manifest);
+    _manifest = -1;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::WriteToTempFile(const RunBuffer &buffer, AsyncIO* io) {
+    const size_t size = buffer.Size();
+    const bool tagged = (buffer.tags.size() == size) && size > 0;
+    RunOutput output(*this, buffer.runNumber, io);
+    output.SetInputRange(buffer.inputBegin, buffer.inputEnd);
+    Entry mappedEntry;
+    for (size_t i = 0; i < size; ++i) { // Write the contents of the current buffer to the temporary file.
+        if (_mapped != NULL) { //  copy the record out of the mapping; this is the only copy it ever gets in Pass1.
+            mappedEntry.key = buffer.tags[i].key;
+            mappedEntry.record.FromText(_mapped->Line(buffer.firstLine + buffer.tags[i].index));
+            output.Append(mappedEntry);
+        }
+        else
+            output.Append(tagged ? buffer.entries[buffer.tags[i].index] : buffer.entries[i]); //  gather by tag when tag-sorted.
+    }
+    output.Close();
+    if (_mapped != NULL) _mapped->Release(buffer.firstLine, buffer.lines); //    the run's lines were charged only until now.
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+bool ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ReadEntry(std::istream &input, Entry &entry) {
+    if (_mapped != NULL) {
+        if (_nextLine >= _mapped->Records()) return false;
+        const std::string_view line = _mapped->Line(_nextLine++);
+        entry.key = _keyOf(line);
+        entry.record.FromText(line);
+        return true;
+    }
+    if (!(input >> entry.record)) return false;
+    entry.key = _keyOf(entry.record);
+    return true;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ReplacementSelection(std::istream &input, uint64_t bytes) {
+    //  A record in the selection heap: the run it is headed for, its key, its position in the input
+    //  (which keeps equal keys in input order, so the merged output is the same as with load-sort-store runs)
+    //  and the slot holding the record itself.
+    struct Node {
+        unsigned int run;
+        Key key;
+        uint64_t sequence;
+        size_t slot;
+    };
+    uint64_t comparisons = 0;
+    auto after = [this, &comparisons](const Node &a, const Node &b) { //  std::*_heap keep the greatest on top, so order them backwards.
+        ++comparisons;
+        if (a.run != b.run) return a.run > b.run;
+        if (_compare(a.key, b.key)) return false;
+        if (_compare(b.key, a.key)) return true;
+        return a.sequence > b.sequence;
+    };
+    const size_t capacity = (size_t)std::min<uint64_t>(bytes / (sizeof(Entry) + sizeof(Node)), UINT32_MAX);
+    if (capacity == 0) {
+        std::cerr << "The buffer is too small to hold a single record for replacement selection." << std::endl;
+        exit(1);
+    }
+    _memory.Charge(capacity * (sizeof(Entry) + sizeof(Node)));
+    std::vector<Entry> slots(capacity);
+    std::vector<Node> heap;
+    heap.reserve(capacity);
+    uint64_t sequence = 0;
+    while (heap.size() < capacity && ReadEntry(input, slots[heap.size()])) { //    fill the memory budget,
+        Node node = {0, slots[heap.size()].key, sequence++, heap.size()};
+        heap.push_back(node);
+    }
+    std::make_heap(heap.begin(), heap.end(), after);
+    // Mapped lines are copied into the slots as they are read, so the pages behind them are dropped a megabyte at a time.
+    const uint64_t releaseLines = (_mapped != NULL) ? std::max<uint64_t>(1, (1 << 20) / _mapped->Stride()) : 0;
+    uint64_t released = 0;
+    
+    std::unique_ptr<AsyncIO> io(AsyncIO::Create(_options.ioEngine));
+    std::unique_ptr<RunOutput> output;
+    unsigned int currentRun = 0;
+    while (heap.empty() == false) { //  then keep writing out the smallest record that can still extend the current run.
+        std::pop_heap(heap.begin(), heap.end(), after);
+        const Node lowest = heap.back();
+        if (output == NULL || lowest.run != currentRun) { //    nothing left for this run: start the next one.
+            if (output != NULL) output->Close();
+            currentRun = lowest.run;
+            output.reset(new RunOutput(*this, _chunkCounter++, io.get()));
+        }
+        output->Append(slots[lowest.slot]);
+        if (ReadEntry(input, slots[lowest.slot])) { //   the freed slot takes the next record, for this run if it can still follow.
+            Node next = {lowest.run, slots[lowest.slot].key, sequence++, lowest.slot};
+            if (_compare(next.key, lowest.key)) ++next.run;
+            heap.back() = next;
+            std::push_heap(heap.begin(), heap.end(), after);
+        }
+        else
+            heap.pop_back();
+        if (_mapped != NULL && _nextLine - released >= releaseLines) {
+            _mapped->Release(released, _nextLine - released);
+            released = _nextLine;
+        }
+    }
+    if (_mapped != NULL) _mapped->Release(released, _nextLine - released);
+    if (output != NULL) output->Close();
+    performanceCounters().recordsRead += sequence;
+    performanceCounters().comparisons += comparisons;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::SortRun(RunBuffer &buffer) {
+    RunSortMethod method = _options.runSort;
+    if (method == AutoSort)
+        method = RadixOrder<Key, Compare>::supported ? RadixSort : DirectSort;
+    if (method == DirectSort && _mapped != NULL)
+        method = TagSort; //   mapped records cannot be moved, only their line numbers.
+    buffer.tags.clear();
+    // The comparisons are functor types known at compile time, so std::sort inlines them.
+    if (method == TagSort || method == RadixSort) {
+        const size_t size = buffer.Size();
+        buffer.tags.resize(size);
+        for (size_t i = 0; i < size; ++i) {
+            //  mapped keys are parsed here, on the sorting thread, straight out of the line.
+            buffer.tags[i].key = (_mapped != NULL) ? _keyOf(_mapped->Line(buffer.firstLine + i)) : buffer.entries[i].key;
+            buffer.tags[i].index = (uint32_t)i;
+        }
+        if (method == RadixSort)
+            RadixSortTags(buffer);
+        else {
+            // Ties are broken by buffer position, so equal keys keep their input order (as they do in the radix sort).
+            uint64_t comparisons = 0;
+            auto precedes = [this, &comparisons](const Tag &t1, const Tag &t2) {
+                ++comparisons;
+                return _compare(t1.key, t2.key) || (!_compare(t2.key, t1.key) && t1.index < t2.index);
+            };
+            sort(buffer.tags.begin(), buffer.tags.end(), precedes); //  sort the tags; the records themselves never move.
+            performanceCounters().comparisons += comparisons;
+        }
+    }
+    else
+        MergeSortEntries(buffer);
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+bool ExternalSorter<Record, KeyExtractor, Compare, Combiner>::SortsDirectly() const {
+    return _mapped == NULL && (_options.runSort == DirectSort || (_options.runSort == AutoSort && !RadixOrder<Key, Compare>::supported));
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::MergeSortEntries(RunBuffer &buffer) {
+    // Stable, so equal keys keep their input order as they do in the tag and radix sorts, whichever sort made the run.
+    // It works like std::stable_sort, but through a scratch buffer of half a run that Pass1 reserved against the budget,
+    // rather than one borrowed from the heap for every run: each half is sorted on its own, then the two are merged.
+    uint64_t comparisons = 0;
+    auto precedes = [this, &comparisons](const Entry &e1, const Entry &e2) { ++comparisons; return _compare(e1.key, e2.key); };
+    const size_t INSERTION_RUN = 32;
+    auto sortHalf = [&](Entry* first, size_t n, Entry* scratch) { //    bottom-up, ping-ponging through a scratch of n records.
+        for (size_t start = 0; start < n; start += INSERTION_RUN) { //  insertion-sort short runs,
+            const size_t end = std::min(start + INSERTION_RUN, n);
+            for (size_t i = start + 1; i < end; ++i) {
+                Entry entry = first[i];
+                size_t j = i;
+                for (; j > start && precedes(entry, first[j - 1]); --j)
+                    first[j] = first[j - 1];
+                first[j] = entry;
+            }
+        }
+        Entry* from = first;
+        Entry* to = scratch;
+        for (size_t width = INSERTION_RUN; width < n; width *= 2) { //   then merge them in pairs; std::merge is stable.
+            for (size_t low = 0; low < n; low += 2 * width) {
+                const size_t middle = std::min(low + width, n), high = std::min(low + 2 * width, n);
+                std::merge(from + low, from + middle, from + middle, from + high, to + low, precedes);
+            }
+            std::swap(from, to);
+        }
+        if (from != first) std::copy(from, from + n, first);
+    };
+    const size_t n = buffer.entries.size();
+    const size_t half = n / 2;
+    Entry* entries = buffer.entries.data();
+    Entry* scratch = buffer.mergeScratch.data();
+    sortHalf(entries, half, scratch);
+    sortHalf(entries + half, n - half, scratch);
+    std::copy(entries, entries + half, scratch); //    the front half moves aside and is merged with the back half from the front;
+    size_t i = 0, j = half, out = 0; //    the output never overtakes the back half it reads from.
+    while (i < half && j < n)
+        entries[out++] = precedes(entries[j], scratch[i]) ? entries[j++] : scratch[i++];
+    while (i < half)
+        entries[out++] = scratch[i++];
+    performanceCounters().comparisons += comparisons;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::RadixSortTags(RunBuffer &buffer) {
+    typedef RadixOrder<Key, Compare> Order;
+    if constexpr (!Order::supported) { //   not an integer order: fall back to comparing tags.
+        uint64_t comparisons = 0;
+        auto precedes = [this, &comparisons](const Tag &t1, const Tag &t2) {
+            ++comparisons;
+            return _compare(t1.key, t2.key) || (!_compare(t2.key, t1.key) && t1.index < t2.index);
+        };
+        sort(buffer.tags.begin(), buffer.tags.end(), precedes);
+        performanceCounters().comparisons += comparisons;
+    }
+    else {
+        typedef typename std::make_unsigned<Key>::type Bits;
+        const size_t DIGITS = sizeof(Key); //   one byte per pass.
+        const size_t n = buffer.tags.size();
+        // Flipping the sign bit makes signed keys order correctly as unsigned ones; flipping every bit reverses the order.
+        const Bits flip = (std::is_signed<Key>::value ? (Bits)((Bits)1 << (8 * sizeof(Bits) - 1)) : (Bits)0)
+                        ^ (Order::descending ? (Bits)~(Bits)0 : (Bits)0);
+        
+        // Build the histograms of every digit in a single sweep. The inner loop has a fixed trip count
+        // and no data-dependent branches, so the compiler can unroll and vectorize the digit extraction.
+        std::vector<size_t> counts(DIGITS * 256, 0);
+        for (size_t i = 0; i < n; ++i) {
+            const Bits bits = (Bits)buffer.tags[i].key ^ flip;
+            for (size_t d = 0; d < DIGITS; ++d)
+                ++counts[d * 256 + ((bits >> (8 * d)) & 0xFF)];
+        }
+        
+        buffer.radixScratch.resize(n); //  the ping-pong buffer; its capacity was reserved against the memory budget in Pass1.
+        Tag* from = &buffer.tags[0];
+        Tag* to = &buffer.radixScratch[0];
+        for (size_t d = 0; d < DIGITS; ++d) {
+            size_t* count = &counts[d * 256];
+            if (count[((((Bits)from[0].key ^ flip)) >> (8 * d)) & 0xFF] == n) continue; // every key shares this digit.
+            size_t offset = 0;
+            for (size_t b = 0; b < 256; ++b) { //    turn the counts into bucket offsets.
+                size_t c = count[b];
+                count[b] = offset;
+                offset += c;
+            }
+            for (size_t i = 0; i < n; ++i) //  a stable scatter keeps equal keys in buffer order.
+                to[count[(((Bits)from[i].key ^ flip) >> (8 * d)) & 0xFF]++] = from[i];
+            std::swap(from, to);
+        }
+        if (from != &buffer.tags[0]) //  an odd number of passes left the result in the scratch buffer.
+            buffer.tags.swap(buffer.radixScratch);
+    }
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ReserveRunBuffer(RunBuffer &buffer, size_t capacity) {
+    if (_mapped == NULL)
+        buffer.entries.reserve(capacity);
+    if (_options.runSort != DirectSort || _mapped != NULL) { //  tag arrays are sized from the same budget as the buffer.
+        buffer.tags.reserve(capacity);
+        buffer.radixScratch.reserve(capacity);
+    }
+    if (SortsDirectly())
+        buffer.mergeScratch.resize((capacity + 1) / 2);
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+bool ExternalSorter<Record, KeyExtractor, Compare, Combiner>::FillRunBuffer(std::istream &input, RunBuffer &buffer, size_t capacity) {
+    buffer.entries.clear(); //  clear the buffer for the next run
+    buffer.inputBegin = InputPosition(input);
+    if (_mapped != NULL) { //   a mapped run is just the next range of lines.
+        buffer.firstLine = _nextLine;
+        buffer.lines = (size_t)std::min<uint64_t>(capacity, _mapped->Records() - _nextLine);
+        _nextLine += buffer.lines;
+        buffer.inputEnd = InputPosition(input);
+        if (buffer.lines == 0)
+            return false;
+        performanceCounters().recordsRead += buffer.lines;
+        buffer.runNumber = _chunkCounter++;
+        return true;
+    }
+    buffer.lines = 0;
+    Entry entry;
+    while (buffer.entries.size() < capacity && input >> entry.record) { // keep reading until the quota is filled or the input runs out
+        entry.key = _keyOf(entry.record); //    parse the sort key once, at ingest.
+        buffer.entries.push_back(entry);
+    }
+    buffer.inputEnd = InputPosition(input);
+    if (buffer.entries.empty())
+        return false;
+    performanceCounters().recordsRead += buffer.entries.size();
+    buffer.runNumber = _chunkCounter++; //  runs are numbered in input order, whichever thread finishes them first.
+    return true;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::Pass1() {
+    if (_memory.Total() == 0) {std::cerr << "Seriously? You want me to do merge sort with a buffer of size 0?" << std::endl; exit(1);}
+    PhaseMeter meter("pass1");
+    _inputBytes = fileBytes(_inFile);
+    performanceCounters().bytesRead += _inputBytes - _resumeOffset; //  mapped or streamed, the input is read once.
+    MappedRecordFile mapped;
+    std::ifstream input;
+    if (_options.mapInput && mapped.Open(_inFile)) //  fixed-length lines are read in place; anything else through a stream.
+        _mapped = &mapped;
+    else
+        input.open(_inFile.c_str(), std::ios::in);
+    if (_resumeOffset > 0) { //    skip the input that the runs of an interrupted sort already hold.
+        if (_mapped != NULL)
+            _nextLine = (_resumeOffset + _mapped->Stride() - 1) / _mapped->Stride(); //   the last line may lack its newline.
+        else
+            input.seekg(_resumeOffset);
+    }
+    
+    // The runs get whatever the budget has left after the run writer's blocks. A buffered record costs its entry,
+    // or its mapped line, which stays resident while the run is sorted, plus a tag and its radix scratch when tag-sorted,
+    // and half an entry of merge scratch when sorted directly.
+    const uint64_t writerBytes = RunFileWriter<Key, Record>::MemoryFor(_writeBlockBytes, _options.runCodec);
+    _memory.Charge(writerBytes);
+    const bool tagged = (_options.runSort != DirectSort || _mapped != NULL);
+    const uint64_t recordBytes = ((_mapped != NULL) ? _mapped->Stride() : sizeof(Entry)) + (tagged ? 2 * sizeof(Tag) : 0)
+    + (SortsDirectly() ? (sizeof(Entry) + 1) / 2 : 0);
+    const size_t maxRecords = (size_t)std::min<uint64_t>(_memory.Available() / recordBytes, UINT32_MAX);
+    // Pass2 must at least merge two runs into its output, however small the runs are.
+    const uint64_t mergeBytes = std::max<uint64_t>(2 * _writeBlockBytes, writerBytes)
+    + 2 * RunReader::MemoryFor(DIRECT_IO_ALIGNMENT, _options.runCodec, _writeBlockBytes);
+    if (_memory.Total() < std::max(writerBytes + recordBytes, mergeBytes)) {
+        std::cerr << "A buffer of " << _memory.Total() << " bytes is too small to sort with; it needs at least "
+        << std::max(writerBytes + recordBytes, mergeBytes) << " bytes." << std::endl;
+        exit(1);
+    }
+    
+    if (_options.replacementSelection) { //    runs of about twice the budget on random input, much longer on presorted input.
+        // Its runs are not ranges of the input, so they are only checkpointed once they are all written,
+        // with nominal ranges that merely keep them in order; a checkpoint reuses all of them or none.
+        const unsigned int firstRun = _chunkCounter;
+        _holdRuns = true;
+        ReplacementSelection(input, _memory.Available());
+        _holdRuns = false;
+        for (unsigned int r = firstRun; r < _runs.size(); ++r) {
+            _runs[r].inputBegin = r;
+            _runs[r].inputEnd = (r + 1 < _runs.size()) ? r + 1 : _inputBytes;
+            CheckpointRun(r, _runs[r]);
+        }
+    }
+    else if (_options.threads <= 1) { // read, sort and spill one run at a time.
+        RunBuffer buffer;
+        ReserveRunBuffer(buffer, maxRecords);
+        _memory.Charge(maxRecords * recordBytes);
+        std::unique_ptr<AsyncIO> io(AsyncIO::Create(_options.ioEngine));
+        while (FillRunBuffer(input, buffer, maxRecords)) {
+            SortRun(buffer); // sort the buffer and
+            WriteToTempFile(buffer, io.get()); // write the sorted data to a temp file
+        }
+    }
+    else {
+        // A pipeline: this thread reads, a pool of workers sorts independent runs, and a writer thread spills them.
+        // The budget is split evenly between one buffer being filled, one per worker and one being written,
+        // so the buffers in flight never hold more than maxRecords records in total.
+        const size_t buffersInFlight = _options.threads + 2;
+        const size_t capacity = std::max<size_t>(1, maxRecords / buffersInFlight);
+        _memory.Charge(buffersInFlight * capacity * recordBytes);
+        std::vector<RunBuffer> buffers(buffersInFlight);
+        BlockingQueue<RunBuffer*> freeBuffers, sortQueue, writeQueue;
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            ReserveRunBuffer(buffers[i], capacity);
+            freeBuffers.Push(&buffers[i]);
+        }
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < _options.threads; ++t) {
+            workers.push_back(std::thread([&]() {
+                RunBuffer* buffer;
+                while (sortQueue.Pop(buffer)) {
+                    SortRun(*buffer);
+                    writeQueue.Push(buffer);
+                }
+            }));
+        }
+        std::thread writer([&]() {
+            std::unique_ptr<AsyncIO> io(AsyncIO::Create(_options.ioEngine));
+            RunBuffer* buffer;
+            while (writeQueue.Pop(buffer)) {
+                WriteToTempFile(*buffer, io.get());
+                freeBuffers.Push(buffer); //  hand the buffer back to the reader.
+            }
+        });
+        RunBuffer* buffer;
+        while (freeBuffers.Pop(buffer) && FillRunBuffer(input, *buffer, capacity))
+            sortQueue.Push(buffer);
+        sortQueue.Close();
+        for (size_t t = 0; t < workers.size(); ++t)
+            workers[t].join();
+        writeQueue.Close();
+        writer.join();
+    }
+    
+    _mapped = NULL;
+    meter.Detail("memory_peak_bytes", _memory.Peak());
+    _memory.Release(_memory.Used()); //    Pass1's buffers are all gone.
+    //  The new runs are numbered after every run a checkpoint reused, which leaves empty slots between them.
+    _runs.erase(std::remove_if(_runs.begin(), _runs.end(), [](const RunInfo &run) { return run.fileName.empty(); }), _runs.end());
+    for (unsigned int i = 0; i < _runs.size(); ++i) { //  add the tempFiles to the list of tempFiles, in run order.
+        temporaryFilesNamesList.push_back(_runs[i].fileName);
+        meter.Report().runRecords.push_back(_runs[i].records);
+        meter.Report().runBytes.push_back(_runs[i].fileBytes);
+    }
+    meter.Detail("runs", _runs.size());
+    if (_options.checkpoint) meter.Detail("resumed_runs", _resumedRuns);
+    meter.Finish();
+    std::cout << "Phase 1 completed..." << std::endl;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::MergeRange(std::vector<RunReader*> &inputs, std::ostream &output) {
+    LoserTree<Key, Compare> tree(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) //  offer the first record of each input
+        if (inputs[i]->Exhausted() == false) tree.Set(i, inputs[i]->Current().key);
+    tree.Build();
+    Entry folded; //    the record that equal keys are being combined into.
+    bool folding = false;
+    uint64_t read = 0, written = 0;
+    while (tree.Empty() == false) { //  keep working until every input is exhausted
+        RunReader &lowest = *inputs[tree.Winner()]; //   the earliest record in sort order, ties going to the lower-numbered run.
+        ++read;
+        if constexpr (Combiner::enabled) { //    equal keys arrive together, the earliest first: fold them into it.
+            const Entry &entry = lowest.Current();
+            if (folding && !_compare(folded.key, entry.key) && !_compare(entry.key, folded.key))
+                _combine(folded.record, entry.record);
+            else {
+                if (folding) {
+                    output << folded.record << '\n';
+                    ++written;
+                }
+                folded = entry;
+                folding = true;
+            }
+        }
+        else {
+            output << lowest.Current().record << '\n'; //    write it straight from the input block
+            ++written;
+        }
+        if (lowest.Advance())
+            tree.Replace(lowest.Current().key); //  one leaf-to-root replay per record
+        else
+            tree.Exhaust();
+    }
+    if (folding) {
+        output << folded.record << '\n';
+        ++written;
+    }
+    PerformanceCounters &counters = performanceCounters();
+    counters.recordsRead += read;
+    counters.recordsWritten += written;
+    counters.comparisons += tree.Comparisons();
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+bool ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ParallelMerge(uint64_t textWidth) {
+    const size_t parts = _options.threads;
+    const size_t runs = _runs.size();
+    const size_t SAMPLES_PER_RUN = 32 * parts;
+    
+    // Sample keys evenly from every run and take their quantiles as the splitters between the key ranges.
+    std::vector<Key> samples;
+    for (size_t r = 0; r < runs; ++r) {
+        const uint64_t sampled = std::min<uint64_t>(SAMPLES_PER_RUN, _runs[r].records);
+        for (size_t j = 0; j < sampled; ++j)
+            samples.push_back(temporaryFilesList[r]->KeyAt(_runs[r].records * j / sampled));
+    }
+    sort(samples.begin(), samples.end(), _compare);
+    
+    // bounds[p][r] is the first record of run r that belongs to key range p: the first one ordered after splitter p.
+    // Equal keys always fall into the same range, so every range can be merged on its own.
+    std::vector<std::vector<uint64_t> > bounds(parts + 1, std::vector<uint64_t>(runs, 0));
+    for (size_t r = 0; r < runs; ++r) {
+        bounds[parts][r] = _runs[r].records;
+        for (size_t p = 1; p < parts; ++p) {
+            const Key splitter = samples[samples.size() * p / parts];
+            uint64_t low = bounds[p - 1][r], high = _runs[r].records;
+            while (low < high) { //  binary search for the first key after the splitter.
+                uint64_t middle = low + (high - low) / 2;
+                if (_compare(splitter, temporaryFilesList[r]->KeyAt(middle))) high = middle;
+                else low = middle + 1;
+            }
+            bounds[p][r] = low;
+        }
+    }
+    
+    // Every output line has the same length, so the output offset of each range follows from the records before it.
+    uint64_t totalRecords = 0;
+    for (size_t r = 0; r < runs; ++r)
+        totalRecords += _runs[r].records;
+    { std::ofstream output(_outFile.c_str(), std::ios::out); }
+    if (truncate(_outFile.c_str(), totalRecords * textWidth) != 0) {
+        std::cerr << "Unable to size the output file (" << _outFile << "): " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    
+    // A thread that fails only records why; the caller exits once every thread has stopped.
+    std::vector<std::string> failures(parts);
+    std::vector<std::thread> workers;
+    for (size_t p = 0; p < parts; ++p) {
+        workers.push_back(std::thread([this, p, runs, textWidth, &bounds, &failures]() {
+            std::unique_ptr<AsyncIO> io(AsyncIO::Create(_options.ioEngine)); //  every merge thread drives its own I/O.
+            uint64_t offset = 0;
+            for (size_t r = 0; r < runs; ++r)
+                offset += bounds[p][r];
+            std::vector<RunReader*> inputs;
+            for (size_t r = 0; r < runs && failures[p].empty(); ++r) {
+                inputs.push_back(new RunReader);
+                if (inputs.back()->Open(_runs[r].fileName, io.get(), bounds[p][r], bounds[p + 1][r] - bounds[p][r],
+                                        _mergeBlockBytes, _options.directIO) == false)
+                    failures[p] = "Unable to open temp file (" + _runs[r].fileName + ").  It is not a complete run file.";
+            }
+            int fd = failures[p].empty() ? open(_outFile.c_str(), O_WRONLY) : -1;
+            if (fd < 0 && failures[p].empty())
+                failures[p] = "Unable to open the output file (" + _outFile + "): " + strerror(errno) + ".";
+            if (fd >= 0) {
+                {
+                    AsyncFileBuffer buffer(fd, offset * textWidth, io.get(), _writeBlockBytes);
+                    std::ostream output(&buffer);
+                    MergeRange(inputs, output);
+                    output.flush();
+                }
+                close(fd);
+            }
+            for (size_t r = 0; r < inputs.size(); ++r)
+                delete inputs[r];
+        }));
+    }
+    for (size_t p = 0; p < parts; ++p)
+        workers[p].join();
+    for (size_t p = 0; p < parts; ++p) {
+        if (failures[p].empty() == false) {
+            std::cerr << failures[p] << "  Exiting." << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+size_t ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ReadBlockBytes(size_t readers) const {
+    const uint64_t headroom = alignUp(sizeof(Entry), DIRECT_IO_ALIGNMENT); //   what RunFileReader keeps in front of each block.
+    const uint64_t perBlock = _mergeBudget / std::max<size_t>(readers, 1) / 2; //   every reader double-buffers.
+    const uint64_t block = (perBlock > headroom) ? (perBlock - headroom) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT : 0;
+    return (size_t)std::min<uint64_t>(std::max<uint64_t>(block, DIRECT_IO_ALIGNMENT), MAX_MERGE_READ_BLOCK_BYTES);
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+size_t ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ChooseWindow(const std::vector<uint64_t> &sizes, size_t width) {
+    // Only adjacent runs are merged: equal keys are ordered by run, so merging runs across another one would reorder them.
+    uint64_t bytes = 0, fewest = 0;
+    size_t first = 0;
+    for (size_t r = 0; r < sizes.size(); ++r) {
+        bytes += sizes[r];
+        if (r >= width) bytes -= sizes[r - width];
+        if (r + 1 >= width && (r + 1 == width || bytes < fewest)) {
+            fewest = bytes;
+            first = r + 1 - width;
+        }
+    }
+    return first;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+double ExternalSorter<Record, KeyExtractor, Compare, Combiner>::MergeCost(std::vector<uint64_t> sizes, size_t fanIn,
+                                                                          size_t readersPerRun, unsigned int &merges) const {
+    // The smallest runs are merged first. The first merge takes just enough runs that every later one
+    // can take fanIn, so no merge is left with only a few runs to combine at the end.
+    double seconds = 0;
+    merges = 0;
+    size_t width = (sizes.size() > fanIn) ? (sizes.size() - 1) % (fanIn - 1) + 1 : 0;
+    if (width == 1) width = fanIn;
+    while (sizes.size() > fanIn) {
+        const size_t first = ChooseWindow(sizes, width);
+        uint64_t bytes = 0;
+        for (size_t r = first; r < first + width; ++r)
+            bytes += sizes[r];
+        seconds += 2.0 * bytes / MERGE_DISK_BYTES_PER_SECOND + (double)bytes / ReadBlockBytes(width) * MERGE_BLOCK_SECONDS;
+        sizes.erase(sizes.begin() + first + 1, sizes.begin() + first + width);
+        sizes[first] = bytes;
+        width = fanIn;
+        ++merges;
+    }
+    uint64_t total = 0;
+    for (size_t r = 0; r < sizes.size(); ++r)
+        total += sizes[r];
+    return seconds + 2.0 * total / MERGE_DISK_BYTES_PER_SECOND
+    + (double)total / ReadBlockBytes(sizes.size() * readersPerRun) * MERGE_BLOCK_SECONDS;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+uint64_t ExternalSorter<Record, KeyExtractor, Compare, Combiner>::ReaderHandles(bool parallel) const {
+    struct rlimit limit;
+    rlim_t handles = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) handles = limit.rlim_cur;
+    // Every thread of a parallel merge also opens the output file and its own I/O engine.
+    const uint64_t reserved = RESERVED_FILE_HANDLES + (parallel ? _options.threads * (1 + AsyncIO::HandlesFor(_options.ioEngine)) : 0);
+    return (handles > reserved) ? handles - reserved : 0;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::PlanMerge(bool parallel, AsyncIO* io) {
+    const size_t runs = _runs.size();
+    // The final merge of a parallel merge opens every run once for its splitters and once per thread.
+    const size_t readersPerRun = parallel ? _options.threads + 1 : 1;
+    const size_t handlesPerReader = _options.directIO ? 2 : 1; //   O_DIRECT readers keep a buffered handle for the footer and key lookups.
+    
+    // The widest merge the file handles and the memory budget allow, with the smallest block that still suits O_DIRECT.
+    const uint64_t fanInByHandles = ReaderHandles(parallel) / handlesPerReader;
+    const uint64_t fanInByMemory = _mergeBudget / RunReader::MemoryFor(DIRECT_IO_ALIGNMENT, _options.runCodec, _writeBlockBytes);
+    const size_t maxFanIn = (size_t)std::max<uint64_t>(2, std::min(fanInByHandles / readersPerRun, fanInByMemory / readersPerRun));
+    
+    // Candidates: merge everything at once if possible, at the widest fan-in otherwise,
+    // or take one or two more passes over the data for the sake of larger, cheaper block reads.
+    std::vector<uint64_t> sizes;
+    for (size_t r = 0; r < runs; ++r)
+        sizes.push_back(_runs[r].records * sizeof(Entry));
+    std::vector<size_t> candidates(1, std::min(runs, maxFanIn));
+    for (unsigned int levels = 2; levels <= 3; ++levels) {
+        size_t fanIn = 2;
+        for (uint64_t reach = 0; ; ++fanIn) { //  the smallest fan-in that merges every run in that many levels.
+            reach = 1;
+            for (unsigned int l = 0; l < levels && reach < runs; ++l)
+                reach *= fanIn;
+            if (reach >= runs) break;
+        }
+        if (fanIn <= maxFanIn) candidates.push_back(fanIn);
+    }
+    size_t fanIn = 0;
+    double cheapest = 0;
+    unsigned int merges = 0;
+    for (size_t c = 0; c < candidates.size(); ++c) {
+        if (candidates[c] < 2) continue;
+        unsigned int candidateMerges;
+        const double cost = MergeCost(sizes, candidates[c], readersPerRun, candidateMerges);
+        if (fanIn == 0 || cost < cheapest) {
+            fanIn = candidates[c];
+            cheapest = cost;
+            merges = candidateMerges;
+        }
+    }
+    
+    _fanIn = (merges > 0) ? fanIn : runs;
+    _intermediateMerges = merges;
+    if (merges > 0) {
+        std::cout << "Merging " << runs << " runs with a fan-in of " << fanIn << " (" << merges << " intermediate merges)..." << std::endl;
+        size_t width = (runs - 1) % (fanIn - 1) + 1;
+        if (width == 1) width = fanIn;
+        while (_runs.size() > fanIn) { //    the same steps MergeCost priced, on the real runs.
+            sizes.clear();
+            for (size_t r = 0; r < _runs.size(); ++r)
+                sizes.push_back(_runs[r].records * sizeof(Entry));
+            MergeRuns(ChooseWindow(sizes, width), width, ReadBlockBytes(width), io);
+            width = fanIn;
+        }
+    }
+    _mergeBlockBytes = ReadBlockBytes(_runs.size() * readersPerRun);
+    temporaryFilesNamesList.clear();
+    for (size_t r = 0; r < _runs.size(); ++r)
+        temporaryFilesNamesList.push_back(_runs[r].fileName);
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::MergeRuns(size_t first, size_t count, size_t blockBytes, AsyncIO* io) {
+    std::vector<RunReader*> inputs;
+    for (size_t r = first; r < first + count; ++r) {
+        inputs.push_back(new RunReader);
+        if (inputs.back()->Open(_runs[r].fileName, io, 0, UINT64_MAX, blockBytes, _options.directIO) == false) {
+            std::cerr << "Unable to open temp file (" << _runs[r].fileName << ").  It is not a complete run file.  Exiting." << std::endl;
+            exit(1);
+        }
+    }
+    const size_t live = _runs.size();
+    const unsigned int runNumber = _chunkCounter++;
+    {
+        RunOutput output(*this, runNumber, io); //    registers the merged run as _runs[runNumber].
+        LoserTree<Key, Compare> tree(inputs.size());
+        for (size_t i = 0; i < inputs.size(); ++i)
+            if (inputs[i]->Exhausted() == false) tree.Set(i, inputs[i]->Current().key);
+        tree.Build();
+        uint64_t read = 0;
+        while (tree.Empty() == false) {
+            RunReader &lowest = *inputs[tree.Winner()];
+            output.Append(lowest.Current());
+            ++read;
+            if (lowest.Advance())
+                tree.Replace(lowest.Current().key);
+            else
+                tree.Exhaust();
+        }
+        output.SetInputRange(_runs[first].inputBegin, _runs[first + count - 1].inputEnd); //  it supersedes its inputs in the checkpoint.
+        output.Close(); //    counts the records it wrote.
+        performanceCounters().recordsRead += read;
+        performanceCounters().comparisons += tree.Comparisons();
+    }
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        delete inputs[i];
+        remove(_runs[first + i].fileName.c_str());
+    }
+    // The merged run takes the place of its inputs.
+    const RunInfo merged = _runs[runNumber];
+    _runs.resize(live); //  drop the slots that RunOutput grew _runs by.
+    _runs.erase(_runs.begin() + first + 1, _runs.begin() + first + count);
+    _runs[first] = merged;
+}
+
+template <typename Record, typename KeyExtractor, typename Compare, typename Combiner>
+void ExternalSorter<Record, KeyExtractor, Compare, Combiner>::Pass2() { //    Merge the sorted temp files.
+    // uses a loser tree over the runs, each read through a block of records
+    PhaseMeter meter("pass2");
+    meter.Detail("runs", _runs.size());
+    std::unique_ptr<AsyncIO> io(AsyncIO::Create(_options.ioEngine));
+    
+    // A key-range parallel merge writes each range at its own offset, which is only known when every output line has the same length.
+    uint64_t textWidth = _runs.empty() ? 0 : _runs[0].textWidth;
+    for (size_t r = 0; r < _runs.size(); ++r)
+        if (_runs[r].textWidth != textWidth) textWidth = 0;
+    // Every thread reads every run, so the budget and the file handles must also hold a two-way merge with a reader per run and thread.
+    const uint64_t smallestReader = RunReader::MemoryFor(DIRECT_IO_ALIGNMENT, _options.runCodec, _writeBlockBytes);
+    const bool parallel = (_options.threads > 1 && textWidth > 0
+                           && _options.threads * 2 * _writeBlockBytes + 2 * (_options.threads + 1) * smallestReader <= _memory.Available()
+                           && ReaderHandles(true) >= 2 * (_options.threads + 1) * (_options.directIO ? 2 : 1));
+    
+    // The run readers get whatever the budget has left after the output buffers of the final merge,
+    // or the run writer of an intermediate merge, whichever is larger.
+    const uint64_t outputBytes = std::max<uint64_t>((parallel ? _options.threads : 1) * 2 * _writeBlockBytes,
+                                                    RunFileWriter<Key, Record>::MemoryFor(_writeBlockBytes, _options.runCodec));
+    _memory.Charge(outputBytes);
+    _mergeBudget = _memory.Available();
+    
+    // Merge runs ahead of time until the final merge fits both the memory budget and the file handles.
+    PlanMerge(parallel, io.get());
+    const uint64_t readerBytes = _runs.size() * (parallel ? _options.threads + 1 : 1)
+    * RunReader::MemoryFor(_mergeBlockBytes, _options.runCodec, _writeBlockBytes);
+    _memory.Charge(readerBytes);
+    
+    // open the sorted temp files up for merging.
+    // loads RunReader pointers into temporaryFilesList
+    OpenTempFiles(io.get());
+    
+    if (parallel) {
+        if (ParallelMerge(textWidth) == false) { //    every merge thread has stopped; stop this thread's I/O too before exiting.
+            CloseTemporaryFiles();
+            io.reset();
+            exit(1);
+        }
+    }
+    else {
+        int fd = open(_outFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Unable to create the output file (" << _outFile << "): " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        {
+            AsyncFileBuffer buffer(fd, 0, io.get(), _writeBlockBytes); //  the output is written behind the merge.
+            std::ostream output(&buffer);
+            MergeRange(temporaryFilesList, output);
+            output.flush();
+        }
+        close(fd);
+    }
+    CloseTemporaryFiles();  // Clean up the temporary files.
+    _memory.Release(outputBytes + readerBytes);
+    meter.Detail("fan_in", _fanIn);
+    meter.Detail("intermediate_merges", _intermediateMerges);
+    meter.Detail("merge_threads", parallel ? _options.threads : 1);
+    meter.Detail("read_block_bytes", _mergeBlockBytes);
+    meter.Finish();
+    std::cout << "Phase 2 completed..." << std::endl;
+}
+
+// How many partitions an overflowing hash aggregation spills to, and the largest block size of each partition file.
+const size_t HASH_PARTITIONS = 16;
+const size_t HASH_PARTITION_BLOCK_BYTES = 64 * 1024;
+
+// A hash-based group-by, the alternative to sorting when records only need to be grouped, not ordered.
+// Records are folded into an open-addressing table keyed by their key in a single scan of the input.
+// The table holds as many groups as the memory budget leaves room for. When a new group no longer fits,
+// its records are partitioned by hash into files instead, as in a grace hash join, and every partition is
+// aggregated on its own afterwards, partitioning again if it still has too many groups.
+// The first record of each group is the one the others are folded into, as with a combining sort;
+// the groups themselves come out in no particular order.
+template <typename Record, typename KeyExtractor, typename Combiner>
+struct HashAggregator {
+    HashAggregator(const std::string &inFile, // constructor
+                   const std::string &outFile,
+                   const std::string &maxBufferSize,
+                   std::string tempPath,
+                   const SorterOptions &options = SorterOptions());
+    
+    void Aggregate(); //    group the input into the output file.
+    
+    typedef typename KeyExtractor::Key Key;
+    typedef KeyedRecord<Key, Record> Entry;
+    typedef RunFileWriter<Key, Record> PartitionWriter;
+    
+    //  A slot of the open-addressing table: a key and where its group is, or group == 0 if the slot is empty.
+    struct Slot {
+        Key key;
+        uint32_t group; //  1 + the index of the group in _groups.
+    };
+    
+    std::string _inFile;
+    std::string _outFile;
+    MemoryBudget _memory; //    bufferSize, in bytes.
+    size_t _partitionBlockBytes;
+    std::string _tempPath;
+    KeyExtractor _keyOf;
+    Combiner _combine;
+    SorterOptions _options;
+    std::vector<Entry> _groups; //    the groups in the order they were first seen.
+    std::vector<Slot> _slots;
+    size_t _maxGroups;
+    unsigned int _partitionCounter;
+    uint64_t _records;
+    uint64_t _groupsWritten;
+    uint64_t _partitionBytes; //    the records spilled to partitions, and the bytes they took on disk.
+    uint64_t _partitionFileBytes;
+    std::unique_ptr<AsyncIO> _io; //  the output and every partition file go through one engine.
+    void Fold(const Entry &entry, unsigned int level, std::vector<PartitionWriter*> &partitions, std::vector<std::string> &names);
+    void Flush(std::ostream &output); //   writes the groups of the table out and empties it.
+    void FinishPartitions(std::ostream &output, unsigned int level, std::vector<PartitionWriter*> &partitions, std::vector<std::string> &names);
+    static uint64_t Hash(Key key, unsigned int level); //  every level hashes differently, so a partition spreads over the next level's table.
+};
+
+template <typename Record, typename KeyExtractor, typename Combiner>
+HashAggregator<Record, KeyExtractor, Combiner>::HashAggregator (const std::string &inFile, // constructor
+                                                                const std::string &outFile,
+                                                                const std::string &maxBufferSize,
+                                                                std::string tempPath,
+                                                                const SorterOptions &options)
+: _inFile(inFile)
+, _outFile(outFile)
+, _memory(parseMemorySize(maxBufferSize))
+, _partitionBlockBytes(DIRECT_IO_ALIGNMENT)
+, _tempPath(tempPath)
+, _options(options)
+, _maxGroups(0)
+, _partitionCounter(0)
+, _records(0)
+, _groupsWritten(0)
+, _partitionBytes(0)
+, _partitionFileBytes(0) {}
+
+template <typename Record, typename KeyExtractor, typename Combiner>
+uint64_t HashAggregator<Record, KeyExtractor, Combiner>::Hash(Key key, unsigned int level) {
+    uint64_t h = (uint64_t)key + (level + 1) * 0x9e3779b97f4a7c15ULL; //    the splitmix64 finalizer.
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+template <typename Record, typename KeyExtractor, typename Combiner>
+void HashAggregator<Record, KeyExtractor, Combiner>::Fold(const Entry &entry, unsigned int level,
+                                                          std::vector<PartitionWriter*> &partitions, std::vector<std::string> &names) {
+    const uint64_t h = Hash(entry.key, level);
+    const size_t mask = _slots.size() - 1;
+    size_t i = h & mask;
+    for (; _slots[i].group != 0; i = (i + 1) & mask) { //    linear probing; the table is never more than half full.
+        if (_slots[i].key == entry.key) {
+            _combine(_groups[_slots[i].group - 1].record, entry.record);
+            return;
+        }
+    }
+    if (_groups.size() < _maxGroups) { //  a new group.
+        _slots[i].key = entry.key;
+        _slots[i].group = _groups.size() + 1;
+        _groups.push_back(entry);
+        return;
+    }
+    // The table is full: the group goes to a partition file. None of its records can have reached the table,
+    // because the table stays full from now on, so they all follow it there, in input order.
+    const size_t p = (h >> 60) % HASH_PARTITIONS; //   the high bits; the slot came from the low ones.
+    if (partitions.empty()) {
+        partitions.assign(HASH_PARTITIONS, NULL);
+        names.assign(HASH_PARTITIONS, std::string());
+    }
+    if (partitions[p] == NULL) {
+        std::stringstream name;
+        if (_tempPath.size() == 0)
+            name << _inFile << ".partition." << _partitionCounter++;
+        else
+            name << _tempPath << "/" << stl_basename(_inFile) << ".partition." << _partitionCounter++;
+        names[p] = name.str();
+        partitions[p] = new PartitionWriter;
+        if (partitions[p]->Open(names[p], _io.get(), _options.directIO, _partitionBlockBytes, _options.runCodec) == false) {
+            std::cerr << "Unable to create partition file (" << names[p] << "): " << strerror(errno) << std::endl;
+            exit(1);
+        }
+    }
+    partitions[p]->Append(entry);
+}
+
+template <typename Record, typename KeyExtractor, typename Combiner>
+void HashAggregator<Record, KeyExtractor, Combiner>::Flush(std::ostream &output) {
+    for (size_t g = 0; g < _groups.size(); ++g)
+        output << _groups[g].record << '\n';
+    _groupsWritten += _groups.size();
+    performanceCounters().recordsWritten += _groups.size();
+    _groups.clear();
+    std::fill(_slots.begin(), _slots.end(), Slot());
+}
+
+template <typename Record, typename KeyExtractor, typename Combiner>
+void HashAggregator<Record, KeyExtractor, Combiner>::FinishPartitions(std::ostream &output, unsigned int level,
+                                                                      std::vector<PartitionWriter*> &partitions, std::vector<std::string> &names) {
+    for (size_t p = 0; p < partitions.size(); ++p) { //    close every partition first, so that only one level's files are ever being written.
+        if (partitions[p] == NULL) continue;
+        if (partitions[p]->Close() == false) {
+            std::cerr << "Unable to write partition file (" << names[p] << "): " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        _partitionBytes += partitions[p]->Records() * sizeof(Entry);
+        _partitionFileBytes += partitions[p]->FileBytes();
+        performanceCounters().recordsWritten += partitions[p]->Records();
+        delete partitions[p];
+        partitions[p] = NULL;
+    }
+    for (size_t p = 0; p < names.size(); ++p) { //  then aggregate the partitions that the table overflowed into one by one.
+        if (names[p].empty()) continue;
+        std::vector<PartitionWriter*> children;
+        std::vector<std::string> childNames;
+        {
+            RunFileReader<Key, Record> input;
+            if (input.Open(names[p], _io.get(), 0, UINT64_MAX, _partitionBlockBytes, _options.directIO) == false) {
+                std::cerr << "Unable to open partition file (" << names[p] << ").  Exiting." << std::endl;
+                exit(1);
+            }
+            for (bool more = !input.Exhausted(); more; more = input.Advance())
+                Fold(input.Current(), level + 1, children, childNames);
+            performanceCounters().recordsRead += input.Footer().records;
+        }
+        remove(names[p].c_str());
+        Flush(output);
+        FinishPartitions(output, level + 1, children, childNames);
+    }
+}
+
+template <typename Record, typename KeyExtractor, typename Combiner>
+void HashAggregator<Record, KeyExtractor, Combiner>::Aggregate() {
+    if (_memory.Total() == 0) {std::cerr << "Seriously? You want me to aggregate with a buffer of size 0?" << std::endl; exit(1);}
+    PhaseMeter meter("hash");
+    performanceCounters().bytesRead += fileBytes(_inFile);
+    // The table gets whatever the budget has left after the output buffers, the partition writers that are open
+    // while one partition is read back, and its reader. The partition blocks shrink with the budget.
+    const uint64_t partitionBlock = _memory.Total() / (8 * HASH_PARTITIONS) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    _partitionBlockBytes = (size_t)std::min<uint64_t>(std::max<uint64_t>(partitionBlock, DIRECT_IO_ALIGNMENT), HASH_PARTITION_BLOCK_BYTES);
+    const size_t outputBlockBytes = _memory.WriteBlockBytes();
+    const uint64_t fixedBytes = 2 * outputBlockBytes
+    + HASH_PARTITIONS * PartitionWriter::MemoryFor(_partitionBlockBytes, _options.runCodec)
+    + RunFileReader<Key, Record>::MemoryFor(_partitionBlockBytes, _options.runCodec, _partitionBlockBytes);
+    _memory.Charge(fixedBytes);
+    
+    // The table is never more than half full, so each group costs its entry and at least two slots:
+    // take the power-of-two table size that leaves room for the most groups.
+    const uint64_t available = _memory.Available();
+    size_t slots = 0;
+    _maxGroups = 0;
+    for (uint64_t s = 2; s * sizeof(Slot) < available && s / 2 <= UINT32_MAX; s *= 2) {
+        const uint64_t groups = std::min<uint64_t>(s / 2, (available - s * sizeof(Slot)) / sizeof(Entry));
+        if (groups > _maxGroups) {
+            _maxGroups = groups;
+            slots = s;
+        }
+    }
+    if (_maxGroups == 0) {
+        std::cerr << "A buffer of " << _memory.Total() << " bytes cannot hold a single group; it needs at least "
+        << fixedBytes + 2 * sizeof(Slot) + sizeof(Entry) << " bytes." << std::endl;
+        exit(1);
+    }
+    _memory.Charge(slots * sizeof(Slot) + _maxGroups * sizeof(Entry));
+    _slots.assign(slots, Slot());
+    _groups.reserve(_maxGroups);
+    _io.reset(AsyncIO::Create(_options.ioEngine));
+    
+    int fd = open(_outFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Unable to create the output file (" << _outFile << "): " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    {
+        AsyncFileBuffer buffer(fd, 0, _io.get(), outputBlockBytes);
+        std::ostream output(&buffer);
+        std::vector<PartitionWriter*> partitions;
+        std::vector<std::string> names;
+        MappedRecordFile mapped;
+        Entry entry;
+        if (_options.mapInput && mapped.Open(_inFile)) { //   a single sequential scan of the input.
+            // The folded lines are dropped a megabyte at a time, as Pass1 drops its runs' lines, so the mapping stays within the budget.
+            const uint64_t releaseLines = std::max<uint64_t>(1, (1 << 20) / mapped.Stride());
+            uint64_t released = 0;
+            for (uint64_t i = 0; i < mapped.Records(); ++i) {
+                const std::string_view line = mapped.Line(i);
+                entry.key = _keyOf(line);
+                entry.record.FromText(line);
+                Fold(entry, 0, partitions, names);
+                if (i + 1 - released == releaseLines) {
+                    mapped.Release(released, releaseLines);
+                    released = i + 1;
+                }
+            }
+            mapped.Release(released, mapped.Records() - released);
+            _records = mapped.Records();
+        }
+        else {
+            std::ifstream input(_inFile.c_str(), std::ios::in);
+            while (input >> entry.record) {
+                entry.key = _keyOf(entry.record);
+                Fold(entry, 0, partitions, names);
+                ++_records;
+            }
+        }
+        Flush(output);
+        FinishPartitions(output, 0, partitions, names);
+        output.flush();
+    }
+    close(fd);
+    performanceCounters().recordsRead += _records;
+    meter.Detail("groups", _groupsWritten);
+    meter.Detail("table_slots", _slots.size());
+    meter.Detail("partitions", _partitionCounter);
+    meter.Detail("partition_bytes", _partitionFileBytes);
+    meter.Detail("memory_peak_bytes", _memory.Peak());
+    meter.Finish();
+    std::cout << "Aggregated " << _records << " records into " << _groupsWritten << " groups ("
+    << _partitionCounter << " partitions spilled)..." << std::endl;
+    if (_options.runCodec != NoRunCodec && _partitionCounter > 0) reportCompression(_partitionBytes, _partitionFileBytes);
+    std::cout << "Accounted for a peak of " << _memory.Peak() << " of " << _memory.Total() << " budgeted bytes..." << std::endl;
+    _memory.Release(_memory.Used());
+}
+
+// Selects the first K lines of a text file in key order, as a stable sort of the whole file would rank them,
+// without sorting it: one scan keeps the best K lines seen so far in a bounded heap, in O(n log K) time.
+// Lines with equal keys keep their order in the file. With more than one thread, the file is split into
+// ranges of lines whose heaps are filled in parallel and then merged.
+template <typename KeyExtractor, typename Compare>
+struct TopKSelector {
+    TopKSelector(const std::string &inFile, // constructor
+                 const std::string &outFile,
+                 uint64_t k,
+                 const SorterOptions &options = SorterOptions());
+    
+    void Select(); //    write the top K lines to the output file.
+    
+    typedef typename KeyExtractor::Key Key;
+    
+    //  A candidate line: its key, and where it starts in the file, which also breaks ties between equal keys.
+    struct Candidate {
+        Key key;
+        uint64_t offset;
+        uint64_t length;
+    };
+    
+    std::string _inFile;
+    std::string _outFile;
+    uint64_t _k;
+    KeyExtractor _keyOf;
+    Compare _compare;
+    SorterOptions _options;
+    bool RanksBefore(const Candidate &a, const Candidate &b) const;
+    //  scans the lines that start in [begin, end) into a heap of the best K, the worst of them on top; returns how many there were.
+    uint64_t Scan(const char* data, uint64_t size, uint64_t begin, uint64_t end, std::vector<Candidate> &heap) const;
+};
+
+template <typename KeyExtractor, typename Compare>
+TopKSelector<KeyExtractor, Compare>::TopKSelector (const std::string &inFile, // constructor
+                                                   const std::string &outFile,
+                                                   uint64_t k,
+                                                   const SorterOptions &options)
+: _inFile(inFile)
+, _outFile(outFile)
+, _k(k)
+, _options(options) {}
+
+template <typename KeyExtractor, typename Compare>
+bool TopKSelector<KeyExtractor, Compare>::RanksBefore(const Candidate &a, const Candidate &b) const {
+    if (_compare(a.key, b.key)) return true;
+    if (_compare(b.key, a.key)) return false;
+    return a.offset < b.offset; //   equal keys rank in file order.
+}
+
+template <typename KeyExtractor, typename Compare>
+uint64_t TopKSelector<KeyExtractor, Compare>::Scan(const char* data, uint64_t size, uint64_t begin, uint64_t end, std::vector<Candidate> &heap) const {
+    auto ranksBefore = [this](const Candidate &a, const Candidate &b) { return RanksBefore(a, b); };
+    heap.reserve(_k);
+    uint64_t lines = 0;
+    uint64_t released = begin; //    the scan drops the pages behind it a megabyte at a time; the K lines it keeps are read back at the end.
+    for (uint64_t offset = begin; offset < end; ++lines) {
+        if (offset - released >= (1 << 20)) {
+            releaseMappedRange(data, size, released, offset);
+            released = offset;
+        }
+        const char* newline = static_cast<const char*>(memchr(data + offset, '\n', end - offset));
+        const uint64_t length = (newline == NULL) ? end - offset : newline - (data + offset);
+        Candidate candidate;
+        candidate.key = _keyOf(std::string_view(data + offset, length));
+        candidate.offset = offset;
+        candidate.length = length;
+        offset += length + 1;
+        if (heap.size() < _k) {
+            heap.push_back(candidate);
+            std::push_heap(heap.begin(), heap.end(), ranksBefore);
+        }
+        else if (RanksBefore(candidate, heap.front())) { //    it displaces the worst of the best K.
+            std::pop_heap(heap.begin(), heap.end(), ranksBefore);
+            heap.back() = candidate;
+            std::push_heap(heap.begin(), heap.end(), ranksBefore);
+        }
+    }
+    releaseMappedRange(data, size, released, end);
+    return lines;
+}
+
+template <typename KeyExtractor, typename Compare>
+void TopKSelector<KeyExtractor, Compare>::Select() {
+    PhaseMeter meter("select");
+    std::ofstream output(_outFile.c_str(), std::ios::out);
+    int fd = open(_inFile.c_str(), O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        std::cerr << "Unable to open " << _inFile << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    const uint64_t size = status.st_size;
+    if (size == 0 || _k == 0) { //   nothing to rank.
+        close(fd);
+        meter.Finish();
+        return;
+    }
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Unable to map " << _inFile << ": " << strerror(errno) << std::endl;
+        exit(1);
+    }
+    const char* data = static_cast<const char*>(mapping);
+    madvise(mapping, size, MADV_SEQUENTIAL);
+    
+    // Split the file into one range of whole lines per thread.
+    const unsigned int parts = std::max(1u, _options.threads);
+    std::vector<uint64_t> bounds(parts + 1, size);
+    bounds[0] = 0;
+    for (unsigned int p = 1; p < parts; ++p) {
+        uint64_t bound = std::max(bounds[p - 1], size * p / parts);
+        const char* newline = (bound == 0 || bound >= size) ? NULL : static_cast<const char*>(memchr(data + bound - 1, '\n', size - bound + 1));
+        bounds[p] = (bound == 0) ? 0 : (newline == NULL ? size : newline - data + 1); //   the start of the next line.
+    }
+    std::vector<std::vector<Candidate> > heaps(parts);
+    std::vector<uint64_t> lines(parts, 0);
+    if (parts == 1)
+        lines[0] = Scan(data, size, 0, size, heaps[0]);
+    else {
+        std::vector<std::thread> workers;
+        for (unsigned int p = 0; p < parts; ++p)
+            workers.push_back(std::thread([this, data, size, p, &bounds, &heaps, &lines]() { lines[p] = Scan(data, size, bounds[p], bounds[p + 1], heaps[p]); }));
+        for (unsigned int p = 0; p < parts; ++p)
+            workers[p].join();
+    }
+    
+    // Every line of the top K is in the top K of its own range, so the best K of the union are the answer.
+    std::vector<Candidate> best;
+    for (unsigned int p = 0; p < parts; ++p)
+        best.insert(best.end(), heaps[p].begin(), heaps[p].end());
+    sort(best.begin(), best.end(), [this](const Candidate &a, const Candidate &b) { return RanksBefore(a, b); });
+    if (best.size() > _k) best.resize(_k);
+    uint64_t written = 0;
+    for (size_t i = 0; i < best.size(); ++i) {
+        output.write(data + best[i].offset, best[i].length) << '\n';
+        written += best[i].length + 1;
+    }
+    munmap(mapping, size);
+    PerformanceCounters &counters = performanceCounters();
+    counters.bytesRead += size;
+    counters.bytesWritten += written;
+    for (unsigned int p = 0; p < parts; ++p)
+        counters.recordsRead += lines[p];
+    counters.recordsWritten += best.size();
+    meter.Detail("k", _k);
+    meter.Detail("threads", parts);
+    meter.Finish();
+    std::cout << "Selected the top " << best.size() << " lines..." << std::endl;
+}
+
+// How the claims are summed per client between the two sorts.
+enum AggregationMethod {
+    SeparateAggregation, //  sort every claim into outputFile.txt, then sum it in a second pass over that file.
+    FusedAggregation, //   sum the claims while sorting them; outputFile.txt is not written.
+    HashAggregation //  sum the claims in a hash table, without sorting them; outputFile.txt is not written.
+};
+
+// Sums the compensation amounts per client without putting the clients in any order.
+typedef HashAggregator<ClientTotal, ClientIDKey, SumCompensationAmounts> ClientHashAggregator;
+
+// Picks the costliest clients out of the sums without ranking all of them.
+typedef TopKSelector<CompensationAmountKey, std::greater<CompensationAmountKey::Key> > CostliestClientsSelector;
+
+void SumOfCompensationAmounts(const std::string &sortedFile, const std::string &sumFile) {
+    PhaseMeter meter("sum");
+    std::ifstream input(sortedFile.c_str(), std::ios::in);
+    std::ofstream SumOfCompensationAmountsFile;
+    SumOfCompensationAmountsFile.open(sumFile.c_str());
+    // The sum is kept in cents beside the claim rather than printed back into its 10-character amount field,
+    // which a client's total soon outgrows; it is written as the fused and hash aggregations write it.
+    ClientTotal initialRecord, record;
+    SumCompensationAmounts combine;
+    uint64_t read = 0, written = 0;
+    if (input >> initialRecord) ++read;
+    while (input >> record) { // keep reading until there is no more input data
+        ++read;
+        if (std::string(initialRecord.claim.clientID) == std::string(record.claim.clientID)) {
+            combine(initialRecord, record);
+        }
+        else {
+            SumOfCompensationAmountsFile << initialRecord << std::endl;
+            ++written;
+            initialRecord = record;
+        }
+    }
+    if (read > 0) { //  an empty sorted file sums to an empty file.
+        SumOfCompensationAmountsFile << initialRecord << std::endl;
+        ++written;
+    }
+    SumOfCompensationAmountsFile.close();
+    PerformanceCounters &counters = performanceCounters();
+    counters.bytesRead += fileBytes(sortedFile);
+    counters.bytesWritten += fileBytes(sumFile);
+    counters.recordsRead += read;
+    counters.recordsWritten += written;
+    meter.Finish();
+    std::cout << "Summed compensation amounts...\n" << std::endl;
+}
+
+void ShowTopTenCostliestClients(const std::string &rankedFile, uint64_t count = 10) {
+    std::ifstream input(rankedFile.c_str(), std::ios::in);
+    Claim2 record;
+    std::cout << "Client ID" << "\t" << "Sum of Compensation Amount\n\n";
+    for(uint64_t i = 0; i < count; i++) {
+        if (!(input >> record)) break; //    fewer clients than asked for.
+        std::cout << record.clientID << "\t" << record.compensationAmount << std::endl;
+    }
+}
+
+// Parses the sorter flag at argv[i], advancing i past its value; false if argv[i] is not a sorter flag.
+bool parseSorterOption(int argc, char* argv[], int &i, SorterOptions &options) {
+    const std::string flag = argv[i];
+    const std::string value = (i + 1 < argc) ? argv[i + 1] : "";
+    if (flag == "--direct-sort") options.runSort = DirectSort;
+    else if (flag == "--tag-sort") options.runSort = TagSort;
+    else if (flag == "--radix-sort") options.runSort = RadixSort;
+    else if (flag == "--no-mmap") options.mapInput = false;
+    else if (flag == "--replacement-selection") options.replacementSelection = true;
+    else if (flag == "--direct-io") options.directIO = true;
+    else if (flag == "--checkpoint") options.checkpoint = true;
+    else if (flag == "--compress-runs" && value == "none") { options.runCodec = NoRunCodec; ++i; }
+    else if (flag == "--compress-runs" && value == "lz4") { options.runCodec = LZ4RunCodec; ++i; }
+    else if (flag == "--compress-runs" && value == "zstd") {
+#ifdef TPMMS_WITH_ZSTD
+        options.runCodec = ZstdRunCodec;
+#else
+        std::cerr << "This build has no zstd (build with -DTPMMS_WITH_ZSTD -lzstd); compressing runs with LZ4 instead." << std::endl;
+        options.runCodec = LZ4RunCodec;
+#endif
+        ++i;
+    }
+    else if (flag == "--threads" && i + 1 < argc) options.threads = std::max(1, atoi(argv[++i]));
+    else if (flag == "--io" && value == "uring") { options.ioEngine = UringIO; ++i; }
+    else if (flag == "--io" && value == "threads") { options.ioEngine = ThreadPoolIO; ++i; }
+    else if (flag == "--io" && value == "sync") { options.ioEngine = SyncIO; ++i; }
+    else return false;
+    return true;
+}
+
+#ifndef TPMMS_NO_MAIN // The benchmark (bench/bench.cpp) includes this file with -DTPMMS_NO_MAIN and brings its own main.
+// A program shall contain a global function named main, which is the designated start of the program.
+int main(int argc, char* argv[]) {
+    PhaseMeter job("job"); //   the whole run, for the total of the performance report.
+    // This argument is given to the executable pogram via the command line interface.
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " inputFile bufferSize[B|K|M|G] temporaryPath [--direct-sort | --tag-sort | --radix-sort] [--threads N] [--no-mmap] [--replacement-selection] [--compress-runs none|lz4|zstd] [--io uring|threads|sync] [--direct-io] [--checkpoint] [--aggregate separate|fused|hash] [--top K] [--report FILE]" << std::endl;
+        exit(1);
+    }
+    std::string inputFile = argv[1];
+    
+    // Allow the sorter to use an arbitrary amount (in MegaBytes, or with a B, K, M or G suffix) of memory for sorting.
+    std::string bufferSize = argv[2];
+    if (parseMemorySize(bufferSize) == 0 && bufferSize != "0") {
+        std::cerr << "Unable to parse bufferSize (" << bufferSize << "); give megabytes, or bytes with a B, K, M or G suffix." << std::endl;
+        exit(1);
+    }
+    
+    // Once the buffer is full, the sorter will dump the buffer's content to a temporary file and grab another chunk from the input file.
+    std::string temporaryPath = argv[3]; // Allows you to write the intermediate files anywhere you want.
+    
+    SorterOptions options; //  optional flags follow the three positional arguments.
+    AggregationMethod aggregation = SeparateAggregation;
+    uint64_t topK = 0; //  0 ranks every client with a second sort; otherwise only the costliest K are selected.
+    std::string reportFile = "performanceReport.json";
+    for (int i = 4; i < argc; ++i) {
+        std::string flag = argv[i];
+        if (parseSorterOption(argc, argv, i, options)) continue;
+        if (flag == "--top" && i + 1 < argc && atoll(argv[i + 1]) > 0) topK = atoll(argv[++i]);
+        else if (flag == "--report" && i + 1 < argc) reportFile = argv[++i];
+        else if (flag == "--aggregate" && i + 1 < argc && std::string(argv[i + 1]) == "separate") { aggregation = SeparateAggregation; ++i; }
+        else if (flag == "--aggregate" && i + 1 < argc && std::string(argv[i + 1]) == "fused") { aggregation = FusedAggregation; ++i; }
+        else if (flag == "--aggregate" && i + 1 < argc && std::string(argv[i + 1]) == "hash") { aggregation = HashAggregation; ++i; }
+        else {
+            std::cerr << "Unknown option " << flag << std::endl;
+            exit(1);
+        }
+    }
+    
+    PerformanceReport &report = PerformanceReport::Global();
+    report.Step("claims"); //   everything up to the sums works on the claims, ...
+    if (aggregation == FusedAggregation) { //   one sort groups the claims and sums them on the way.
+        TPMMSAggregate aggregator(inputFile, "SumOfCompensationAmountsFile.txt", bufferSize, temporaryPath, options);
+        aggregator.Sort();
+        std::cout << "Summed compensation amounts...\n" << std::endl;
+    }
+    else if (aggregation == HashAggregation) { //    one scan groups the claims in a hash table instead.
+        ClientHashAggregator aggregator(inputFile, "SumOfCompensationAmountsFile.txt", bufferSize, temporaryPath, options);
+        aggregator.Aggregate();
+        std::cout << "Summed compensation amounts...\n" << std::endl;
+    }
+    else {
+        // Create a new instance of the TPMMS class.
+        TPMMS firstSorter(inputFile, "outputFile.txt", bufferSize, temporaryPath, options);
+        firstSorter.Sort();
+        std::cout << "Going to sum compensation amounts..." << std::endl;
+        SumOfCompensationAmounts("outputFile.txt", "SumOfCompensationAmountsFile.txt");
+    }
+    
+    report.Step("clients"); //    and everything after them on the clients.
+    if (topK > 0) { //  a single scan keeps the costliest K clients; nobody else needs to be ranked.
+        CostliestClientsSelector selector("SumOfCompensationAmountsFile.txt", "outputFile2.txt", topK, options);
+        selector.Select();
+    }
+    else {
+        TPMMS2 secondSorter("SumOfCompensationAmountsFile.txt", "outputFile2.txt", bufferSize, temporaryPath, options);
+        secondSorter.Sort();
+    }
     
-    const double EXECUTION_TIME = (double)(clock() - BEGINNING) / CLOCKS_PER_SEC / 60; // Report the execution time (in minutes).
+    const PhaseReport total = job.Measure(); // Report the execution time on the wall clock, not the processor's.
+    const double EXECUTION_TIME = total.wallSeconds / 60; // (in minutes)
     
-    secondSorter->ShowTopTenCostliestClients();
+    ShowTopTenCostliestClients("outputFile2.txt", (topK > 0) ? topK : 10);
     
     std::cout << "\n" << "Execution time in minutes:\t" << EXECUTION_TIME << "\n"; // Print out the time elapsed sorting.
+    std::cout << "CPU time in minutes:\t" << total.cpuSeconds / 60 << "\n";
+    if (report.Write(reportFile, total) == false)
+        std::cerr << "Unable to write the performance report (" << reportFile << ")." << std::endl;
 }
+#endif